@@ -0,0 +1,835 @@
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include "hashmap.h"
+
+/*
+ * Measures hashmap.h on string keys shaped like the URLs of an access log.
+ * For every table size it reports the memory taken by the slots, the load
+ * the table reached, how often it grew and the average latency of a lookup
+ * that hits and of one that misses, both in random order so every lookup is
+ * a fresh walk into the table. --hash-bits keeps only the top bits of the
+ * hash to model a skewed hasher: many keys then share a home slot.
+ *
+ * --latency times every single insert instead, once with the default
+ * stop-the-world growth and once with HASHMAP_INCREMENTAL_REHASH, and reports
+ * the percentiles: a put that doubles the whole table shows up in the tail.
+ *
+ * --threads N counts a skewed stream of --lookups keys with N threads, once
+ * into a single map behind one lock, once into a sharded map with a lock per
+ * shard and once into a map per thread that are merged at the end.
+ *
+ * --hashers compares the hashers of hashmap.h over keys of growing length: the
+ * time to hash a key on its own and the time of an insert and of a hit in a
+ * map that uses it.
+ *
+ * --batch times random hits and updates of present keys one call per key and
+ * through hashmap_get_batch and hashmap_upsert_batch, which prefetch the slots
+ * of HASHMAP_BATCH_SIZE keys at a time. The gain shows once the table no longer
+ * fits in the last level cache, so the sizes grow up to --keys.
+ *
+ * --snapshot FILE writes a map of --keys keys with a 64-bit value each to FILE
+ * with hashmap_snapshot_write, maps it back and times random hits in the mapped
+ * file against the same hits in the map it was written from.
+ */
+#define DEFAULT_KEYS 4000000
+#define DEFAULT_LOOKUPS 4000000
+#define DEFAULT_HASH_BITS 32
+#define DEFAULT_SEED 1
+#define KEY_SIZE 32
+#define SHARDS_PER_THREAD 16
+#define HASHER_MAX_KEYS (1024 * 1024)
+#define HASHER_MAX_KEY_LEN 256
+
+struct bench_options {
+	unsigned int keys;
+	unsigned int lookups;
+	unsigned int hash_bits;
+	uint64_t seed;
+	int latency;
+	unsigned int threads;
+	int hashers;
+	int batch;
+	const char* snapshot;
+};
+
+static unsigned int hash_bits;
+// the hashes are summed into it so the hashing loop isn't optimized away
+static volatile hashmap_uint32_t hash_sink;
+
+// xorshift64*, the same generator as loggen
+static uint64_t next_random(uint64_t* state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static hashmap_uint32_t skewed_hasher(hashmap_uint32_t seed, const void* key, hashmap_uint32_t len) {
+	hashmap_uint32_t hash = hashmap_crc32_hasher(seed, key, len);
+	return hash_bits < 32 ? hash >> (32 - hash_bits) << (32 - hash_bits) : hash;
+}
+
+static double now_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+// the i-th key, absent keys come from a separate range of ids
+static int format_key(char* key, unsigned int i, int absent) {
+	return snprintf(key, KEY_SIZE, "%s/item/%u", absent ? "/missing" : "", i);
+}
+
+// average ns per hashmap_get over order, counts the hits into *found
+static double time_lookups(const struct hashmap_s* map, const char* keys, const unsigned int* lens,
+                           const unsigned int* order, unsigned int lookups, unsigned int* found) {
+	*found = 0;
+	double start = now_ns();
+	for (unsigned int i = 0; i < lookups; i++) {
+		unsigned int k = order[i];
+		*found += hashmap_get(map, keys + (size_t)k * KEY_SIZE, lens[k]) != NULL;
+	}
+
+	return (now_ns() - start) / lookups;
+}
+
+static int run_size(unsigned int keys_count, const struct bench_options* options, char* keys, unsigned int* lens,
+                    unsigned int* order, uint64_t* state) {
+	struct hashmap_s map;
+	struct hashmap_create_options_s create = { .hasher = skewed_hasher, .initial_capacity = 1024 };
+	if (hashmap_create_ex(create, &map) != 0) {
+		printf("failed to create a hashmap\n");
+		return -1;
+	}
+
+	int exit_code = 0;
+	double start = now_ns();
+	for (unsigned int i = 0; i < keys_count; i++) {
+		if (hashmap_put(&map, keys + (size_t)i * KEY_SIZE, lens[i], &lens[i]) != 0) {
+			printf("failed to put data into the hashmap at %u keys\n", i);
+			exit_code = -1;
+			goto clean_up;
+		}
+	}
+	double insert_ns = (now_ns() - start) / keys_count;
+
+	for (unsigned int i = 0; i < options->lookups; i++) {
+		order[i] = next_random(state) % keys_count;
+	}
+
+	unsigned int hits, misses;
+	double hit_ns = time_lookups(&map, keys, lens, order, options->lookups, &hits);
+
+	// the absent keys sit right after the present ones
+	for (unsigned int i = 0; i < options->lookups; i++) {
+		order[i] = keys_count + next_random(state) % keys_count;
+	}
+	double miss_ns = time_lookups(&map, keys, lens, order, options->lookups, &misses);
+
+	if (hits != options->lookups || misses != 0) {
+		printf("wrong lookups: %u of %u hits found, %u misses found\n", hits, options->lookups, misses);
+		exit_code = -1;
+	}
+
+	size_t bytes = (size_t)hashmap_capacity(&map) * sizeof(struct hashmap_element_s);
+	printf("%-10u %10u %10.1f %6.3f %8u %10.1f %9.1f %9.1f\n", keys_count, hashmap_capacity(&map),
+		bytes / (1024.0 * 1024.0), (double)hashmap_num_entries(&map) / hashmap_capacity(&map),
+		hashmap_num_rehashes(&map), insert_ns, hit_ns, miss_ns);
+
+	clean_up:
+	hashmap_destroy(&map);
+	return exit_code;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+// the latency under which the given share of the sorted samples falls
+static double percentile(const double* sorted, unsigned int count, double share) {
+	size_t i = (size_t)(share * count);
+	return sorted[i < count ? i : count - 1];
+}
+
+static int run_latency(const struct bench_options* options, const char* keys, unsigned int* lens) {
+	static const struct {
+		const char* name;
+		hashmap_uint32_t flags;
+	} modes[] = { { "stop-the-world", 0 }, { "incremental", HASHMAP_INCREMENTAL_REHASH } };
+
+	double* samples = malloc(sizeof(double) * options->keys);
+	if (samples == NULL) {
+		printf("failed to allocate memory\n");
+		return -1;
+	}
+
+	int exit_code = 0;
+	printf("%-15s %10s %10s %8s %8s %8s %9s %11s\n", "growth", "keys", "total ms", "p50 ns", "p99 ns", "p999 ns", "p9999 ns", "max ns");
+	for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]) && exit_code == 0; i++) {
+		struct hashmap_s map;
+		struct hashmap_create_options_s create = { .hasher = skewed_hasher, .initial_capacity = 1024, .flags = modes[i].flags };
+		if (hashmap_create_ex(create, &map) != 0) {
+			printf("failed to create a hashmap\n");
+			exit_code = -1;
+			break;
+		}
+
+		double total = 0;
+		for (unsigned int k = 0; k < options->keys; k++) {
+			double start = now_ns();
+			int result = hashmap_put(&map, keys + (size_t)k * KEY_SIZE, lens[k], &lens[k]);
+			samples[k] = now_ns() - start;
+			total += samples[k];
+			if (result != 0) {
+				printf("failed to put data into the hashmap at %u keys\n", k);
+				exit_code = -1;
+				break;
+			}
+		}
+
+		if (exit_code == 0) {
+			qsort(samples, options->keys, sizeof(double), compare_doubles);
+			printf("%-15s %10u %10.1f %8.0f %8.0f %8.0f %9.0f %11.0f\n", modes[i].name, options->keys, total / 1e6,
+				percentile(samples, options->keys, 0.5), percentile(samples, options->keys, 0.99),
+				percentile(samples, options->keys, 0.999), percentile(samples, options->keys, 0.9999),
+				samples[options->keys - 1]);
+		}
+
+		hashmap_destroy(&map);
+	}
+
+	free(samples);
+	return exit_code;
+}
+
+enum count_mode {
+	COUNT_SHARED,
+	COUNT_PER_THREAD,
+};
+
+struct count_thread {
+	pthread_t thread;
+	const char* keys;
+	const unsigned int* lens;
+	const unsigned int* stream;
+	unsigned int begin;
+	unsigned int end;
+	enum count_mode mode;
+	struct hashmap_sharded_s* shared;
+	// the map of the thread and its counters, indexed by the key
+	struct hashmap_s map;
+	hashmap_int64_t* counts;
+	int failed;
+};
+
+static void* count_thread_run(void* arg) {
+	struct count_thread* thread = arg;
+	for (unsigned int i = thread->begin; i < thread->end; i++) {
+		unsigned int k = thread->stream[i];
+		const char* key = thread->keys + (size_t)k * KEY_SIZE;
+		if (thread->mode == COUNT_SHARED) {
+			if (hashmap_sharded_upsert_add(thread->shared, key, thread->lens[k], 1) != 0) {
+				thread->failed = 1;
+				break;
+			}
+			continue;
+		}
+
+		hashmap_int64_t* count = hashmap_get(&thread->map, key, thread->lens[k]);
+		if (count != NULL) {
+			(*count)++;
+			continue;
+		}
+
+		thread->counts[k] = 1;
+		if (hashmap_put(&thread->map, key, thread->lens[k], &thread->counts[k]) != 0) {
+			thread->failed = 1;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+struct merge_context {
+	struct count_thread* into;
+	const hashmap_int64_t* counts;
+};
+
+static int merge_count(void* context, struct hashmap_element_s* element) {
+	struct merge_context* merge = context;
+	unsigned int k = (unsigned int)((hashmap_int64_t*)element->data - merge->counts);
+	if (merge->into->counts[k] == 0
+		&& hashmap_put(&merge->into->map, element->key, element->key_len, &merge->into->counts[k]) != 0) {
+		return 1;
+	}
+
+	merge->into->counts[k] += merge->counts[k];
+	return 0;
+}
+
+static int sum_count(void* context, struct hashmap_element_s* element) {
+	*(hashmap_int64_t*)context += *(hashmap_int64_t*)element->data;
+	return 0;
+}
+
+// counts the stream with the given mode, prints a row and checks the total
+static int run_count(const char* name, enum count_mode mode, unsigned int shards, const struct bench_options* options,
+                     const char* keys, const unsigned int* lens, const unsigned int* stream) {
+	struct count_thread* threads = calloc(options->threads, sizeof(struct count_thread));
+	struct hashmap_sharded_s shared = { 0 };
+	struct hashmap_create_options_s create = { .initial_capacity = 1024 };
+	int exit_code = 0;
+	if (threads == NULL) {
+		printf("failed to allocate memory\n");
+		return -1;
+	}
+
+	if (mode == COUNT_SHARED && hashmap_sharded_create(shards, create, &shared) != 0) {
+		printf("failed to create a hashmap\n");
+		exit_code = -1;
+		goto clean_up;
+	}
+
+	for (unsigned int i = 0; i < options->threads; i++) {
+		struct count_thread* thread = &threads[i];
+		*thread = (struct count_thread) { .keys = keys, .lens = lens, .stream = stream, .mode = mode, .shared = &shared,
+			.begin = (unsigned int)((uint64_t)options->lookups * i / options->threads),
+			.end = (unsigned int)((uint64_t)options->lookups * (i + 1) / options->threads) };
+		if (mode == COUNT_PER_THREAD) {
+			thread->counts = calloc(options->keys, sizeof(hashmap_int64_t));
+			if (thread->counts == NULL || hashmap_create_ex(create, &thread->map) != 0) {
+				printf("failed to create a hashmap\n");
+				exit_code = -1;
+				goto clean_up;
+			}
+		}
+	}
+
+	double start = now_ns();
+	unsigned int started = 0;
+	for (; started < options->threads; started++) {
+		if (pthread_create(&threads[started].thread, NULL, count_thread_run, &threads[started]) != 0) {
+			printf("failed to start a thread\n");
+			exit_code = -1;
+			break;
+		}
+	}
+
+	for (unsigned int i = 0; i < started; i++) {
+		pthread_join(threads[i].thread, NULL);
+		exit_code = threads[i].failed ? -1 : exit_code;
+	}
+	double count_ns = now_ns() - start;
+
+	if (exit_code != 0) {
+		printf("failed to count the stream\n");
+		goto clean_up;
+	}
+
+	hashmap_int64_t total = 0;
+	hashmap_uint32_t entries;
+	if (mode == COUNT_PER_THREAD) {
+		for (unsigned int i = 1; i < options->threads; i++) {
+			struct merge_context merge = { .into = &threads[0], .counts = threads[i].counts };
+			if (hashmap_iterate_pairs(&threads[i].map, merge_count, &merge) != 0) {
+				printf("failed to merge the hashmaps\n");
+				exit_code = -1;
+				goto clean_up;
+			}
+		}
+		hashmap_iterate_pairs(&threads[0].map, sum_count, &total);
+		entries = hashmap_num_entries(&threads[0].map);
+	} else {
+		hashmap_sharded_iterate_pairs(&shared, sum_count, &total);
+		entries = hashmap_sharded_num_entries(&shared);
+	}
+	double total_ns = now_ns() - start;
+
+	if (total != options->lookups) {
+		printf("wrong counts: %" PRId64 " counted of %u\n", (int64_t)total, options->lookups);
+		exit_code = -1;
+	}
+
+	printf("%-15s %8u %8u %10u %10.1f %10.1f %10.1f\n", name, options->threads, mode == COUNT_SHARED ? shards : 0,
+		entries, count_ns / 1e6, (total_ns - count_ns) / 1e6, options->lookups / (total_ns / 1e3));
+
+	clean_up:
+	for (unsigned int i = 0; i < options->threads; i++) {
+		if (threads[i].counts != NULL) {
+			hashmap_destroy(&threads[i].map);
+			free(threads[i].counts);
+		}
+	}
+	hashmap_sharded_destroy(&shared);
+	free(threads);
+	return exit_code;
+}
+
+static int run_threads(const struct bench_options* options, const char* keys, const unsigned int* lens,
+                       unsigned int* stream) {
+	// a uniform pick under a uniform bound, so the low keys are the hot ones
+	uint64_t state = options->seed != 0 ? options->seed : DEFAULT_SEED;
+	for (unsigned int i = 0; i < options->lookups; i++) {
+		stream[i] = next_random(&state) % (1 + next_random(&state) % options->keys);
+	}
+
+	printf("%-15s %8s %8s %10s %10s %10s %10s\n", "counting", "threads", "shards", "keys", "count ms", "merge ms", "M/s");
+	int exit_code = run_count("global lock", COUNT_SHARED, 1, options, keys, lens, stream);
+	if (exit_code == 0) {
+		exit_code = run_count("sharded", COUNT_SHARED, options->threads * SHARDS_PER_THREAD, options, keys, lens, stream);
+	}
+	if (exit_code == 0) {
+		exit_code = run_count("per thread", COUNT_PER_THREAD, 0, options, keys, lens, stream);
+	}
+
+	return exit_code;
+}
+
+// key_len bytes of a path with the decimal i at the end, no digits before it
+static void fill_key(char* key, unsigned int key_len, unsigned int i) {
+	static const char path[] = "/static/img/";
+	char digits[16];
+	int count = snprintf(digits, sizeof(digits), "%u", i);
+	for (unsigned int j = 0; j < key_len - count; j++) {
+		key[j] = path[j % (sizeof(path) - 1)];
+	}
+	memcpy(key + key_len - count, digits, count);
+}
+
+static int run_hasher(const char* name, hashmap_hasher_t hasher, const char* keys, unsigned int key_len,
+                      unsigned int count, const unsigned int* order, unsigned int lookups) {
+	// every key is hashed at least 16 times so short keys still take measurable time
+	unsigned int rounds = 1 + 16 * HASHER_MAX_KEYS / count;
+	hashmap_uint32_t sink = 0;
+	double start = now_ns();
+	for (unsigned int round = 0; round < rounds; round++) {
+		for (unsigned int i = 0; i < count; i++) {
+			sink += hasher(~0u, keys + (size_t)i * key_len, key_len);
+		}
+	}
+	double hash_ns = (now_ns() - start) / ((double)rounds * count);
+
+	struct hashmap_s map;
+	struct hashmap_create_options_s create = { .hasher = hasher, .initial_capacity = 1024 };
+	if (hashmap_create_ex(create, &map) != 0) {
+		printf("failed to create a hashmap\n");
+		return -1;
+	}
+
+	int exit_code = 0;
+	start = now_ns();
+	for (unsigned int i = 0; i < count; i++) {
+		if (hashmap_put(&map, keys + (size_t)i * key_len, key_len, &sink) != 0) {
+			printf("failed to put data into the hashmap at %u keys\n", i);
+			exit_code = -1;
+			goto clean_up;
+		}
+	}
+	double insert_ns = (now_ns() - start) / count;
+
+	unsigned int hits = 0;
+	start = now_ns();
+	for (unsigned int i = 0; i < lookups; i++) {
+		hits += hashmap_get(&map, keys + (size_t)order[i] * key_len, key_len) != NULL;
+	}
+	double hit_ns = (now_ns() - start) / lookups;
+
+	if (hits != lookups || hashmap_num_entries(&map) != count) {
+		printf("wrong lookups: %u of %u hits found, %u of %u keys stored\n", hits, lookups,
+			hashmap_num_entries(&map), count);
+		exit_code = -1;
+	}
+
+	hash_sink = sink;
+	printf("%-8u %10u %-8s %8.2f %10.1f %9.1f\n", key_len, count, name, hash_ns, insert_ns, hit_ns);
+
+	clean_up:
+	hashmap_destroy(&map);
+	return exit_code;
+}
+
+static int run_hashers(const struct bench_options* options, unsigned int* order) {
+	static const unsigned int key_lens[] = { 4, 8, 16, 24, 32, 48, 64, 128, 256 };
+	static const struct {
+		const char* name;
+		hashmap_hasher_t hasher;
+	} hashers[] = { { "crc32", hashmap_crc32_hasher }, { "wyhash", hashmap_wyhash_hasher } };
+
+	unsigned int max_count = options->keys < HASHER_MAX_KEYS ? options->keys : HASHER_MAX_KEYS;
+	char* keys = malloc((size_t)max_count * HASHER_MAX_KEY_LEN);
+	if (keys == NULL) {
+		printf("failed to allocate memory\n");
+		return -1;
+	}
+
+	int exit_code = 0;
+	uint64_t state = options->seed != 0 ? options->seed : DEFAULT_SEED;
+	printf("%-8s %10s %-8s %8s %10s %9s\n", "key len", "keys", "hasher", "hash ns", "insert ns", "hit ns");
+	for (size_t i = 0; i < sizeof(key_lens) / sizeof(key_lens[0]) && exit_code == 0; i++) {
+		// short keys only have room for so many distinct ids after a path character
+		unsigned int key_len = key_lens[i];
+		unsigned int count = 1;
+		for (unsigned int digits = 1; digits < key_len && count < max_count; digits++) {
+			count *= 10;
+		}
+		count = count < max_count ? count : max_count;
+
+		for (unsigned int k = 0; k < count; k++) {
+			fill_key(keys + (size_t)k * key_len, key_len, k);
+		}
+
+		for (unsigned int k = 0; k < options->lookups; k++) {
+			order[k] = next_random(&state) % count;
+		}
+
+		for (size_t j = 0; j < sizeof(hashers) / sizeof(hashers[0]) && exit_code == 0; j++) {
+			exit_code = run_hasher(hashers[j].name, hashers[j].hasher, keys, key_len, count, order, options->lookups);
+		}
+	}
+
+	free(keys);
+	return exit_code;
+}
+
+static int run_batch_size(unsigned int count, const struct bench_options* options, const char* keys,
+                          unsigned int* lens, unsigned int* order, const void** batch_keys,
+                          hashmap_uint32_t* batch_lens, void** values, uint64_t* state) {
+	struct hashmap_s map;
+	struct hashmap_create_options_s create = { .initial_capacity = 1024 };
+	if (hashmap_create_ex(create, &map) != 0) {
+		printf("failed to create a hashmap\n");
+		return -1;
+	}
+
+	int exit_code = 0;
+	for (unsigned int i = 0; i < count; i++) {
+		if (hashmap_put(&map, keys + (size_t)i * KEY_SIZE, lens[i], &lens[i]) != 0) {
+			printf("failed to put data into the hashmap at %u keys\n", i);
+			exit_code = -1;
+			goto clean_up;
+		}
+	}
+
+	// looked up through the copies of the keys after them, as the stored keys
+	// and the ones looked up live apart in a real program
+	for (unsigned int i = 0; i < options->lookups; i++) {
+		order[i] = next_random(state) % count;
+		batch_keys[i] = keys + ((size_t)options->keys + order[i]) * KEY_SIZE;
+		batch_lens[i] = lens[order[i]];
+		values[i] = &lens[order[i]];
+	}
+
+	unsigned int found = 0;
+	double start = now_ns();
+	for (unsigned int i = 0; i < options->lookups; i++) {
+		found += hashmap_get(&map, batch_keys[i], batch_lens[i]) != NULL;
+	}
+	double get_ns = (now_ns() - start) / options->lookups;
+
+	start = now_ns();
+	found += hashmap_get_batch(&map, batch_keys, batch_lens, options->lookups, values);
+	double get_batch_ns = (now_ns() - start) / options->lookups;
+
+	start = now_ns();
+	for (unsigned int i = 0; i < options->lookups; i++) {
+		exit_code |= hashmap_put(&map, batch_keys[i], batch_lens[i], values[i]);
+	}
+	double put_ns = (now_ns() - start) / options->lookups;
+
+	start = now_ns();
+	exit_code |= hashmap_upsert_batch(&map, batch_keys, batch_lens, options->lookups, values);
+	double upsert_batch_ns = (now_ns() - start) / options->lookups;
+
+	if (found != 2 * options->lookups || exit_code != 0 || hashmap_num_entries(&map) != count) {
+		printf("wrong lookups: %u of %u hits found, %u of %u keys stored\n", found, 2 * options->lookups,
+			hashmap_num_entries(&map), count);
+		exit_code = -1;
+	}
+
+	printf("%-10u %10.1f %8.1f %10.1f %7.2fx %8.1f %10.1f %7.2fx\n", count,
+		(double)hashmap_capacity(&map) * sizeof(struct hashmap_element_s) / (1024.0 * 1024.0), get_ns, get_batch_ns,
+		get_ns / get_batch_ns, put_ns, upsert_batch_ns, put_ns / upsert_batch_ns);
+
+	clean_up:
+	hashmap_destroy(&map);
+	return exit_code;
+}
+
+static int run_batch(const struct bench_options* options, char* keys, unsigned int* lens, unsigned int* order) {
+	const void** batch_keys = malloc(sizeof(void*) * options->lookups);
+	hashmap_uint32_t* batch_lens = malloc(sizeof(hashmap_uint32_t) * options->lookups);
+	void** values = malloc(sizeof(void*) * options->lookups);
+	int exit_code = 0;
+	if (batch_keys == NULL || batch_lens == NULL || values == NULL) {
+		printf("failed to allocate memory\n");
+		exit_code = -1;
+		goto clean_up;
+	}
+
+	memcpy(keys + (size_t)options->keys * KEY_SIZE, keys, (size_t)options->keys * KEY_SIZE);
+	uint64_t state = options->seed != 0 ? options->seed : DEFAULT_SEED;
+	printf("%-10s %10s %8s %10s %8s %8s %10s %8s\n", "keys", "MB", "get ns", "batch ns", "gain", "put ns",
+		"batch ns", "gain");
+	for (unsigned int count = 65536; exit_code == 0; count *= 4) {
+		if (count > options->keys) {
+			count = options->keys;
+		}
+
+		exit_code = run_batch_size(count, options, keys, lens, order, batch_keys, batch_lens, values, &state);
+		if (count == options->keys) {
+			break;
+		}
+	}
+
+	clean_up:
+	free(batch_keys);
+	free(batch_lens);
+	free(values);
+	return exit_code;
+}
+
+static int snapshot_value(void* const context, void* const data, const void** const out_value,
+                          hashmap_uint32_t* const out_len) {
+	(void)context;
+	*out_value = data;
+	*out_len = sizeof(uint64_t);
+	return 0;
+}
+
+static int run_snapshot(const struct bench_options* options, const char* keys, const unsigned int* lens,
+                        unsigned int* order) {
+	uint64_t* values = malloc(sizeof(uint64_t) * options->keys);
+	struct hashmap_s map;
+	struct hashmap_create_options_s create = { .initial_capacity = 1024 };
+	if (values == NULL || hashmap_create_ex(create, &map) != 0) {
+		printf("failed to create a hashmap\n");
+		free(values);
+		return -1;
+	}
+
+	int exit_code = 0;
+	for (unsigned int i = 0; i < options->keys; i++) {
+		values[i] = (uint64_t)i * 1000;
+		if (hashmap_put(&map, keys + (size_t)i * KEY_SIZE, lens[i], &values[i]) != 0) {
+			printf("failed to put data into the hashmap at %u keys\n", i);
+			exit_code = -1;
+			goto clean_up;
+		}
+	}
+
+	double start = now_ns();
+	if (hashmap_snapshot_write(&map, options->snapshot, snapshot_value, NULL) != 0) {
+		printf("failed to write the snapshot \"%s\"\n", options->snapshot);
+		exit_code = -1;
+		goto clean_up;
+	}
+	double write_ns = now_ns() - start;
+
+	struct hashmap_snapshot_s snapshot;
+	start = now_ns();
+	if (hashmap_snapshot_open(options->snapshot, create, &snapshot) != 0) {
+		printf("failed to open the snapshot \"%s\"\n", options->snapshot);
+		exit_code = -1;
+		goto clean_up;
+	}
+	double open_ns = now_ns() - start;
+
+	uint64_t state = options->seed != 0 ? options->seed : DEFAULT_SEED;
+	for (unsigned int i = 0; i < options->lookups; i++) {
+		order[i] = next_random(&state) % options->keys;
+	}
+
+	// the first pass over the snapshot also faults its pages in
+	double snapshot_ns[2];
+	unsigned int wrong = 0;
+	for (int pass = 0; pass < 2; pass++) {
+		start = now_ns();
+		for (unsigned int i = 0; i < options->lookups; i++) {
+			unsigned int k = order[i];
+			hashmap_uint32_t len;
+			const void* value = hashmap_snapshot_get(&snapshot, keys + (size_t)k * KEY_SIZE, lens[k], &len);
+			uint64_t stored;
+			if (value == NULL || len != sizeof(stored) || (memcpy(&stored, value, sizeof(stored)), stored != values[k])) {
+				wrong++;
+			}
+		}
+		snapshot_ns[pass] = (now_ns() - start) / options->lookups;
+	}
+
+	start = now_ns();
+	for (unsigned int i = 0; i < options->lookups; i++) {
+		unsigned int k = order[i];
+		wrong += hashmap_get(&map, keys + (size_t)k * KEY_SIZE, lens[k]) != &values[k];
+	}
+	double map_ns = (now_ns() - start) / options->lookups;
+
+	if (wrong != 0 || hashmap_snapshot_num_entries(&snapshot) != options->keys) {
+		printf("wrong lookups: %u of %u wrong, %u of %u keys in the snapshot\n", wrong, 3 * options->lookups,
+			hashmap_snapshot_num_entries(&snapshot), options->keys);
+		exit_code = -1;
+	}
+
+	printf("%-10s %10s %10s %10s %12s %12s %10s\n", "keys", "file MB", "write ms", "open us", "first hit ns",
+		"mapped hit ns", "map hit ns");
+	printf("%-10u %10.1f %10.1f %10.1f %12.1f %12.1f %10.1f\n", options->keys,
+		snapshot.header->file_size / (1024.0 * 1024.0), write_ns / 1e6, open_ns / 1e3, snapshot_ns[0], snapshot_ns[1],
+		map_ns);
+	hashmap_snapshot_close(&snapshot);
+
+	clean_up:
+	hashmap_destroy(&map);
+	free(values);
+	return exit_code;
+}
+
+static int run(const struct bench_options* options) {
+	int exit_code = 0;
+	// the present keys followed by as many absent ones
+	char* keys = malloc((size_t)options->keys * 2 * KEY_SIZE);
+	unsigned int* lens = malloc(sizeof(unsigned int) * options->keys * 2);
+	unsigned int* order = malloc(sizeof(unsigned int) * options->lookups);
+	if (keys == NULL || lens == NULL || order == NULL) {
+		printf("failed to allocate memory\n");
+		exit_code = -1;
+		goto clean_up;
+	}
+
+	if (options->hashers) {
+		exit_code = run_hashers(options, order);
+		goto clean_up;
+	}
+
+	if (options->latency || options->threads > 0 || options->batch || options->snapshot != NULL) {
+		for (unsigned int i = 0; i < options->keys; i++) {
+			lens[i] = format_key(keys + (size_t)i * KEY_SIZE, i, 0);
+		}
+
+		if (options->latency) {
+			exit_code = run_latency(options, keys, lens);
+		} else if (options->threads > 0) {
+			exit_code = run_threads(options, keys, lens, order);
+		} else if (options->snapshot != NULL) {
+			exit_code = run_snapshot(options, keys, lens, order);
+		} else {
+			exit_code = run_batch(options, keys, lens, order);
+		}
+		goto clean_up;
+	}
+
+	uint64_t state = options->seed != 0 ? options->seed : DEFAULT_SEED;
+	printf("%-10s %10s %10s %6s %8s %10s %9s %9s\n", "keys", "slots", "MB", "load", "rehashes", "insert ns", "hit ns", "miss ns");
+	for (unsigned int count = 1000; exit_code == 0; count *= 3) {
+		if (count > options->keys) {
+			count = options->keys;
+		}
+
+		for (unsigned int i = 0; i < count; i++) {
+			lens[i] = format_key(keys + (size_t)i * KEY_SIZE, i, 0);
+			lens[count + i] = format_key(keys + (size_t)(count + i) * KEY_SIZE, i, 1);
+		}
+
+		exit_code = run_size(count, options, keys, lens, order, &state);
+		if (count == options->keys) {
+			break;
+		}
+	}
+
+	clean_up:
+	free(keys);
+	free(lens);
+	free(order);
+	return exit_code;
+}
+
+static void usage(const char* name) {
+	fprintf(stderr, "usage: %s [--keys N] [--lookups N] [--hash-bits 1..32] [--seed N] [--latency]\n"
+		"       [--threads N] [--hashers] [--batch] [--snapshot FILE]\n", name);
+}
+
+// the long name of the option getopt_long() returned as opt
+static const char* option_name(const struct option* options, int opt) {
+	for (; options->name != NULL; options++) {
+		if (options->val == opt) {
+			return options->name;
+		}
+	}
+
+	return "?";
+}
+
+int main(int argc, char *argv[]) {
+	struct bench_options options = { .keys = DEFAULT_KEYS, .lookups = DEFAULT_LOOKUPS, .hash_bits = DEFAULT_HASH_BITS, .seed = DEFAULT_SEED };
+	static const struct option long_options[] = {
+		{ "keys", required_argument, NULL, 'k' },
+		{ "lookups", required_argument, NULL, 'l' },
+		{ "hash-bits", required_argument, NULL, 'b' },
+		{ "seed", required_argument, NULL, 'S' },
+		{ "latency", no_argument, NULL, 'L' },
+		{ "threads", required_argument, NULL, 't' },
+		{ "hashers", no_argument, NULL, 'H' },
+		{ "batch", no_argument, NULL, 'B' },
+		{ "snapshot", required_argument, NULL, 's' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "k:l:b:S:Lt:HBs:", long_options, NULL)) != -1) {
+		int ok = 1;
+		switch (opt) {
+		case 'k':
+			ok = sscanf(optarg, "%u", &options.keys) == 1 && options.keys > 0 && options.keys <= UINT32_MAX / 8;
+			break;
+		case 'l':
+			ok = sscanf(optarg, "%u", &options.lookups) == 1 && options.lookups > 0;
+			break;
+		case 'b':
+			ok = sscanf(optarg, "%u", &options.hash_bits) == 1 && options.hash_bits >= 1 && options.hash_bits <= 32;
+			break;
+		case 'S':
+			ok = sscanf(optarg, "%" SCNu64, &options.seed) == 1;
+			break;
+		case 'L':
+			options.latency = 1;
+			break;
+		case 's':
+			options.snapshot = optarg;
+			break;
+		case 'B':
+			options.batch = 1;
+			break;
+		case 'H':
+			options.hashers = 1;
+			break;
+		case 't':
+			ok = sscanf(optarg, "%u", &options.threads) == 1 && options.threads > 0 && options.threads <= 1024;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+
+		if (!ok) {
+			printf("wrong value \"%s\" for --%s\n", optarg, option_name(long_options, opt));
+			return 1;
+		}
+	}
+
+	if (argc != optind) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	hash_bits = options.hash_bits;
+	return run(&options) == 0 ? 0 : 1;
+}
@@ -39,6 +39,7 @@
 #pragma warning(disable : 4668)
 #endif
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -63,6 +64,16 @@
 #include <intrin.h>
 #endif
 
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #if defined(_MSC_VER)
 #pragma warning(pop)
 #endif
@@ -114,21 +125,49 @@
 #define HASHMAP_ALWAYS_INLINE HASHMAP_WEAK
 #endif
 
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define HASHMAP_PREFETCH(p) _mm_prefetch((const char *)(p), _MM_HINT_T0)
+#elif defined(__clang__) || defined(__GNUC__)
+#define HASHMAP_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define HASHMAP_PREFETCH(p) ((void)(p))
+#endif
+
 #if defined(_MSC_VER) && (_MSC_VER < 1920)
 typedef unsigned __int8 hashmap_uint8_t;
 typedef unsigned __int32 hashmap_uint32_t;
 typedef unsigned __int64 hashmap_uint64_t;
+typedef __int64 hashmap_int64_t;
 #else
 #include <stdint.h>
 typedef uint8_t hashmap_uint8_t;
 typedef uint32_t hashmap_uint32_t;
 typedef uint64_t hashmap_uint64_t;
+typedef int64_t hashmap_int64_t;
+#endif
+
+#if defined(_WIN32)
+typedef SRWLOCK hashmap_lock_t;
+#define HASHMAP_LOCK_INIT(lock) (InitializeSRWLock(lock), 0)
+#define HASHMAP_LOCK(lock) AcquireSRWLockExclusive(lock)
+#define HASHMAP_UNLOCK(lock) ReleaseSRWLockExclusive(lock)
+#define HASHMAP_LOCK_DESTROY(lock) ((void)(lock))
+#else
+typedef pthread_mutex_t hashmap_lock_t;
+#define HASHMAP_LOCK_INIT(lock) pthread_mutex_init(lock, HASHMAP_NULL)
+#define HASHMAP_LOCK(lock) pthread_mutex_lock(lock)
+#define HASHMAP_UNLOCK(lock) pthread_mutex_unlock(lock)
+#define HASHMAP_LOCK_DESTROY(lock) pthread_mutex_destroy(lock)
 #endif
 
 typedef struct hashmap_element_s {
   const void *key;
   hashmap_uint32_t key_len;
-  int in_use;
+  /* 0 for a free slot, otherwise 1 + the distance from the home slot. */
+  hashmap_uint32_t in_use;
+  /* The hash of the key, compared before the keys are and reused to place the
+   * element when the map grows. */
+  hashmap_uint32_t hash;
   void *data;
 } hashmap_element_t;
 
@@ -141,20 +180,113 @@ typedef int (*hashmap_comparer_t)(const void *a, hashmap_uint32_t a_len,
 typedef struct hashmap_s {
   hashmap_uint32_t log2_capacity;
   hashmap_uint32_t size;
+  hashmap_uint32_t rehashes;
+  hashmap_uint32_t flags;
   hashmap_hasher_t hasher;
   hashmap_comparer_t comparer;
   struct hashmap_element_s *data;
+  /* While an incremental rehash runs, the smaller table that is being drained
+   * into data, NULL otherwise. Its slots are drained in order starting after
+   * the free slot old_start, old_next of them are done. */
+  struct hashmap_element_s *old_data;
+  hashmap_uint32_t old_log2_capacity;
+  hashmap_uint32_t old_start;
+  hashmap_uint32_t old_next;
 } hashmap_t;
 
-#define HASHMAP_LINEAR_PROBE_LENGTH (8)
+/* The batch functions hash this many keys and prefetch their home slots
+ * before they look up the first of them. */
+#define HASHMAP_BATCH_SIZE (16)
+
+/* The map grows once an insert would take it past 7/8 of its capacity. */
+#define HASHMAP_MAX_LOAD_NUMERATOR (7)
+#define HASHMAP_MAX_LOAD_DENOMINATOR (8)
+
+/* Grow by moving HASHMAP_REHASH_STEP slots of the old table on every put and
+ * remove instead of all of them in the put that hits the load limit. */
+#define HASHMAP_INCREMENTAL_REHASH (1u)
+#define HASHMAP_REHASH_STEP (4)
 
 typedef struct hashmap_create_options_s {
   hashmap_hasher_t hasher;
   hashmap_comparer_t comparer;
   hashmap_uint32_t initial_capacity;
-  hashmap_uint32_t _;
+  hashmap_uint32_t flags;
 } hashmap_create_options_t;
 
+/* A map for several threads: the keys are spread over a power of two number
+ * of shards by the low bits of their hash, and every shard is a hashmap_s
+ * behind a lock of its own, so threads that work on different keys rarely
+ * wait for each other. */
+#define HASHMAP_SHARD_BLOCK_SIZE (64 * 1024)
+
+typedef struct hashmap_shard_block_s {
+  struct hashmap_shard_block_s *next;
+  hashmap_uint32_t used;
+  hashmap_uint32_t size;
+} hashmap_shard_block_t;
+
+typedef struct hashmap_shard_s {
+  hashmap_lock_t lock;
+  struct hashmap_s map;
+  /* The counters and key copies made by hashmap_sharded_upsert_add. */
+  struct hashmap_shard_block_s *blocks;
+  /* Keeps the locks of neighbouring shards off the same cache line. */
+  hashmap_uint8_t padding[64];
+} hashmap_shard_t;
+
+typedef struct hashmap_sharded_s {
+  hashmap_uint32_t log2_shards;
+  hashmap_hasher_t hasher;
+  struct hashmap_shard_s *shards;
+} hashmap_sharded_t;
+
+/* A snapshot file is the header, the slots and then the keys back to back
+ * followed by the values, each starting on 8 bytes. The slots are laid out like
+ * those of a hashmap_s and hold offsets from the start of the file instead of
+ * pointers, so the file can be mapped anywhere and searched as it is. The
+ * numbers are in the byte order of the machine that wrote it. */
+#define HASHMAP_SNAPSHOT_MAGIC (0x70616d68u)
+#define HASHMAP_SNAPSHOT_VERSION (1u)
+
+typedef struct hashmap_snapshot_header_s {
+  hashmap_uint32_t magic;
+  hashmap_uint32_t version;
+  hashmap_uint32_t log2_capacity;
+  hashmap_uint32_t size;
+  /* The hash of a fixed string, so a snapshot isn't searched with a different
+   * hasher than it was written with. */
+  hashmap_uint32_t probe_hash;
+  hashmap_uint32_t reserved;
+  hashmap_uint64_t file_size;
+} hashmap_snapshot_header_t;
+
+typedef struct hashmap_snapshot_slot_s {
+  hashmap_uint64_t key_offset;
+  hashmap_uint64_t value_offset;
+  hashmap_uint32_t key_len;
+  hashmap_uint32_t value_len;
+  hashmap_uint32_t hash;
+  /* 0 for a free slot, otherwise 1 + the distance from the home slot. */
+  hashmap_uint32_t in_use;
+} hashmap_snapshot_slot_t;
+
+typedef struct hashmap_snapshot_s {
+  const hashmap_uint8_t *bytes;
+  const struct hashmap_snapshot_header_s *header;
+  const struct hashmap_snapshot_slot_s *slots;
+  hashmap_hasher_t hasher;
+  hashmap_comparer_t comparer;
+  /* The mapping made by hashmap_snapshot_open, if any. */
+  void *mapping;
+  hashmap_uint64_t mapping_size;
+} hashmap_snapshot_t;
+
+/* Gives the bytes stored for the data of an element. */
+typedef int (*hashmap_snapshot_value_t)(void *const context, void *const data,
+                                        const void **const out_value,
+                                        hashmap_uint32_t *const out_len);
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
@@ -174,7 +306,11 @@ HASHMAP_WEAK int hashmap_create(const hashmap_uint32_t initial_capacity,
 /// The options members work as follows:
 /// - initial_capacity The initial capacity of the hashmap.
 /// - hasher Which hashing function to use with the hashmap (by default the
-//    crc32 with Robert Jenkins' mix is used).
+///   crc32 with the murmur3 mix is used, hashmap_wyhash_hasher is faster for
+///   keys longer than a few dozen bytes and where there is no crc32
+///   instruction).
+/// - flags HASHMAP_INCREMENTAL_REHASH spreads the work of growing the map over
+///   the puts and removes that follow, so no single put copies the whole map.
 HASHMAP_WEAK int hashmap_create_ex(struct hashmap_create_options_s options,
                                    struct hashmap_s *const out_hashmap);
 
@@ -201,6 +337,42 @@ HASHMAP_WEAK void *hashmap_get(const struct hashmap_s *const hashmap,
                                const void *const key,
                                const hashmap_uint32_t len);
 
+/// @brief Get many elements from the hashmap.
+/// @param hashmap The hashmap to get from.
+/// @param keys The string keys to use.
+/// @param lens The lengths of the string keys.
+/// @param count The number of keys.
+/// @param out_values The storage for the count elements, NULL where none
+/// exists.
+/// @return The number of keys that were found.
+///
+/// The keys are hashed and their slots prefetched HASHMAP_BATCH_SIZE at a time,
+/// then the stored keys in those slots, before any of them is looked up, so
+/// the cache misses of a big map overlap instead of being waited for one after
+/// the other.
+HASHMAP_WEAK hashmap_uint32_t
+hashmap_get_batch(const struct hashmap_s *const hashmap,
+                  const void *const *const keys,
+                  const hashmap_uint32_t *const lens,
+                  const hashmap_uint32_t count, void **const out_values);
+
+/// @brief Put many elements into the hashmap, see hashmap_put.
+/// @param hashmap The hashmap to insert into.
+/// @param keys The string keys to use.
+/// @param lens The lengths of the string keys.
+/// @param count The number of keys.
+/// @param values The values to insert.
+/// @return On success 0 is returned, on failure the elements before the one
+/// that failed are in the map.
+///
+/// Prefetches the slots like hashmap_get_batch, which pays off most when the
+/// keys are mostly in the map already.
+HASHMAP_WEAK int hashmap_upsert_batch(struct hashmap_s *const hashmap,
+                                      const void *const *const keys,
+                                      const hashmap_uint32_t *const lens,
+                                      const hashmap_uint32_t count,
+                                      void *const *const values);
+
 /// @brief Remove an element from the hashmap.
 /// @param hashmap The hashmap to remove from.
 /// @param key The string key to use.
@@ -257,10 +429,136 @@ hashmap_num_entries(const struct hashmap_s *const hashmap);
 HASHMAP_ALWAYS_INLINE hashmap_uint32_t
 hashmap_capacity(const struct hashmap_s *const hashmap);
 
+/// @brief Get the number of times the hashmap has grown.
+/// @param hashmap The hashmap to get the rehash count of.
+/// @return The number of rehashes since the hashmap was created.
+HASHMAP_ALWAYS_INLINE hashmap_uint32_t
+hashmap_num_rehashes(const struct hashmap_s *const hashmap);
+
 /// @brief Destroy the hashmap.
 /// @param hashmap The hashmap to destroy.
 HASHMAP_WEAK void hashmap_destroy(struct hashmap_s *const hashmap);
 
+/// @brief Hash a key with wyhash, to be used as the hasher of a hashmap.
+/// @param seed The seed of the hash.
+/// @param key The string key to hash.
+/// @param len The length of the string key.
+/// @return The 32-bit hash of the key.
+HASHMAP_WEAK hashmap_uint32_t hashmap_wyhash_hasher(const hashmap_uint32_t seed,
+                                                   const void *const key,
+                                                   const hashmap_uint32_t len);
+
+/// @brief Create a hashmap that several threads can use at once.
+/// @param shards The number of shards, rounded up to a power of two.
+/// @param options The options every shard is created with, initial_capacity
+/// is for the whole map.
+/// @param out_hashmap The storage for the created hashmap.
+/// @return On success 0 is returned.
+HASHMAP_WEAK int
+hashmap_sharded_create(const hashmap_uint32_t shards,
+                       struct hashmap_create_options_s options,
+                       struct hashmap_sharded_s *const out_hashmap);
+
+/// @brief Put an element into a sharded hashmap, see hashmap_put.
+HASHMAP_WEAK int hashmap_sharded_put(struct hashmap_sharded_s *const hashmap,
+                                     const void *const key,
+                                     const hashmap_uint32_t len,
+                                     void *const value);
+
+/// @brief Get an element from a sharded hashmap, see hashmap_get.
+HASHMAP_WEAK void *hashmap_sharded_get(struct hashmap_sharded_s *const hashmap,
+                                       const void *const key,
+                                       const hashmap_uint32_t len);
+
+/// @brief Remove an element from a sharded hashmap, see hashmap_remove.
+HASHMAP_WEAK int hashmap_sharded_remove(struct hashmap_sharded_s *const hashmap,
+                                        const void *const key,
+                                        const hashmap_uint32_t len);
+
+/// @brief Add to the counter of a key in a sharded hashmap.
+/// @param hashmap The hashmap to count in.
+/// @param key The string key to use.
+/// @param len The length of the string key.
+/// @param delta The amount to add.
+/// @return On success 0 is returned.
+///
+/// A missing key is inserted with a counter of delta in a single locked step,
+/// its key is copied into memory owned by the map, which lives until the map
+/// is destroyed. The value of such a key is a pointer to its
+/// hashmap_int64_t counter. Keys that are counted shouldn't be put.
+HASHMAP_WEAK int
+hashmap_sharded_upsert_add(struct hashmap_sharded_s *const hashmap,
+                           const void *const key, const hashmap_uint32_t len,
+                           const hashmap_int64_t delta);
+
+/// @brief Iterate over all the elements of a sharded hashmap, see
+/// hashmap_iterate_pairs. Every shard is locked while it is iterated.
+HASHMAP_WEAK int hashmap_sharded_iterate_pairs(
+    struct hashmap_sharded_s *const hashmap,
+    int (*iterator)(void *const, struct hashmap_element_s *const),
+    void *const context);
+
+/// @brief Get the size of a sharded hashmap.
+HASHMAP_WEAK hashmap_uint32_t
+hashmap_sharded_num_entries(struct hashmap_sharded_s *const hashmap);
+
+/// @brief Destroy a sharded hashmap, no thread may be using it.
+HASHMAP_WEAK void hashmap_sharded_destroy(struct hashmap_sharded_s *const hashmap);
+
+/// @brief Write a hashmap to a snapshot file.
+/// @param hashmap The hashmap to write.
+/// @param path The path of the file to create.
+/// @param value The function that gives the bytes to store for the data of an
+/// element, or NULL to store none.
+/// @param context The context to pass as the first argument to value.
+/// @return On success 0 is returned, on failure the file is removed.
+HASHMAP_WEAK int hashmap_snapshot_write(const struct hashmap_s *const hashmap,
+                                        const char *const path,
+                                        hashmap_snapshot_value_t value,
+                                        void *const context);
+
+/// @brief Search a snapshot that is already in memory, without copying it.
+/// @param bytes The snapshot, aligned to 8 bytes.
+/// @param size The size of the snapshot in bytes.
+/// @param options The hasher and comparer the hashmap was created with, the
+/// rest is ignored.
+/// @param out_snapshot The storage for the snapshot.
+/// @return On success 0 is returned, 1 if the bytes aren't a snapshot written
+/// with the same hasher on a machine with the same byte order.
+HASHMAP_WEAK int hashmap_snapshot_view(const void *const bytes,
+                                       const hashmap_uint64_t size,
+                                       struct hashmap_create_options_s options,
+                                       struct hashmap_snapshot_s *const out_snapshot);
+
+#if !defined(_WIN32)
+/// @brief Map a snapshot file read-only and search it where it lies.
+/// @param path The path of the snapshot file.
+/// @param options See hashmap_snapshot_view.
+/// @param out_snapshot The storage for the snapshot.
+/// @return On success 0 is returned.
+HASHMAP_WEAK int hashmap_snapshot_open(const char *const path,
+                                       struct hashmap_create_options_s options,
+                                       struct hashmap_snapshot_s *const out_snapshot);
+#endif
+
+/// @brief Get the value of a key from a snapshot.
+/// @param snapshot The snapshot to search.
+/// @param key The string key to use.
+/// @param len The length of the string key.
+/// @param out_len The storage for the length of the value, may be NULL.
+/// @return The stored bytes of the value, or NULL if the key isn't there.
+HASHMAP_WEAK const void *
+hashmap_snapshot_get(const struct hashmap_snapshot_s *const snapshot,
+                     const void *const key, const hashmap_uint32_t len,
+                     hashmap_uint32_t *const out_len);
+
+/// @brief Get the number of elements in a snapshot.
+HASHMAP_WEAK hashmap_uint32_t
+hashmap_snapshot_num_entries(const struct hashmap_snapshot_s *const snapshot);
+
+/// @brief Close a snapshot, unmapping it if hashmap_snapshot_open mapped it.
+HASHMAP_WEAK void hashmap_snapshot_close(struct hashmap_snapshot_s *const snapshot);
+
 static hashmap_uint32_t hashmap_crc32_hasher(const hashmap_uint32_t seed,
                                              const void *const s,
                                              const hashmap_uint32_t len);
@@ -268,16 +566,63 @@ static int hashmap_memcmp_comparer(const void *const a,
                                    const hashmap_uint32_t a_len,
                                    const void *const b,
                                    const hashmap_uint32_t b_len);
+HASHMAP_ALWAYS_INLINE void hashmap_wyhash_mum(hashmap_uint64_t *const a,
+                                              hashmap_uint64_t *const b);
+HASHMAP_ALWAYS_INLINE hashmap_uint64_t hashmap_wyhash_mix(hashmap_uint64_t a,
+                                                         hashmap_uint64_t b);
+HASHMAP_ALWAYS_INLINE hashmap_uint64_t
+hashmap_wyhash_read(const hashmap_uint8_t *const p, const hashmap_uint32_t n);
 HASHMAP_ALWAYS_INLINE hashmap_uint32_t hashmap_hash_helper_int_helper(
-    const struct hashmap_s *const m, const void *const key,
-    const hashmap_uint32_t len);
+    const struct hashmap_s *const m, const hashmap_uint32_t hash);
 HASHMAP_ALWAYS_INLINE int
 hashmap_hash_helper(const struct hashmap_s *const m, const void *const key,
-                    const hashmap_uint32_t len,
-                    hashmap_uint32_t *const out_index);
-HASHMAP_WEAK int hashmap_rehash_iterator(void *const new_hash,
-                                         struct hashmap_element_s *const e);
+                    const hashmap_uint32_t len, const hashmap_uint32_t hash,
+                    hashmap_uint32_t *const out_index,
+                    hashmap_uint32_t *const out_in_use);
+HASHMAP_ALWAYS_INLINE int hashmap_put_helper(struct hashmap_s *const m,
+                                             const void *const key,
+                                             const hashmap_uint32_t len,
+                                             const hashmap_uint32_t hash,
+                                             void *const value);
+HASHMAP_ALWAYS_INLINE void
+hashmap_prefetch_helper(const struct hashmap_s *const m,
+                        const hashmap_uint32_t hash);
+HASHMAP_ALWAYS_INLINE void
+hashmap_prefetch_key_helper(const struct hashmap_s *const m,
+                            const hashmap_uint32_t hash);
+HASHMAP_ALWAYS_INLINE void
+hashmap_robin_hood_insert(struct hashmap_s *const m, hashmap_uint32_t index,
+                          struct hashmap_element_s element);
+HASHMAP_ALWAYS_INLINE void hashmap_remove_at(struct hashmap_s *const m,
+                                             hashmap_uint32_t index);
+HASHMAP_ALWAYS_INLINE struct hashmap_s
+hashmap_old_table(const struct hashmap_s *const m);
+HASHMAP_ALWAYS_INLINE int hashmap_find_helper(const struct hashmap_s *const m,
+                                              struct hashmap_s *const old,
+                                              const void *const key,
+                                              const hashmap_uint32_t len,
+                                              const hashmap_uint32_t hash,
+                                              hashmap_uint32_t *const out_index);
+HASHMAP_ALWAYS_INLINE void hashmap_rehash_step(struct hashmap_s *const m,
+                                               hashmap_uint32_t slots);
+HASHMAP_WEAK int hashmap_iterate_pairs_helper(
+    struct hashmap_s *const m,
+    int (*iterator)(void *const, struct hashmap_element_s *const),
+    void *const context);
 HASHMAP_ALWAYS_INLINE int hashmap_rehash_helper(struct hashmap_s *const m);
+HASHMAP_ALWAYS_INLINE struct hashmap_shard_s *
+hashmap_shard_helper(const struct hashmap_sharded_s *const m,
+                     const void *const key, const hashmap_uint32_t len);
+HASHMAP_ALWAYS_INLINE void *
+hashmap_shard_alloc_helper(struct hashmap_shard_s *const shard,
+                           const hashmap_uint32_t size);
+HASHMAP_ALWAYS_INLINE void
+hashmap_snapshot_place(struct hashmap_snapshot_slot_s *const slots,
+                       const struct hashmap_element_s **const sources,
+                       const hashmap_uint32_t log2_capacity,
+                       const struct hashmap_element_s *source);
+HASHMAP_ALWAYS_INLINE int hashmap_snapshot_pad(FILE *const file,
+                                               hashmap_uint64_t *const offset);
 HASHMAP_ALWAYS_INLINE hashmap_uint32_t hashmap_clz(const hashmap_uint32_t x);
 
 #if defined(__cplusplus)
@@ -320,142 +665,250 @@ int hashmap_create_ex(struct hashmap_create_options_s options,
     options.comparer = &hashmap_memcmp_comparer;
   }
 
-  out_hashmap->data = HASHMAP_CAST(
-      struct hashmap_element_s *,
-      calloc(options.initial_capacity + HASHMAP_LINEAR_PROBE_LENGTH,
-             sizeof(struct hashmap_element_s)));
+  out_hashmap->data =
+      HASHMAP_CAST(struct hashmap_element_s *,
+                   calloc(options.initial_capacity,
+                          sizeof(struct hashmap_element_s)));
+
+  if (HASHMAP_NULL == out_hashmap->data) {
+    return 1;
+  }
 
   out_hashmap->log2_capacity = 31 - hashmap_clz(options.initial_capacity);
   out_hashmap->size = 0;
+  out_hashmap->rehashes = 0;
+  out_hashmap->flags = options.flags;
   out_hashmap->hasher = options.hasher;
   out_hashmap->comparer = options.comparer;
+  out_hashmap->old_data = HASHMAP_NULL;
+  out_hashmap->old_log2_capacity = 0;
+  out_hashmap->old_start = 0;
+  out_hashmap->old_next = 0;
 
   return 0;
 }
 
 int hashmap_put(struct hashmap_s *const m, const void *const key,
                 const hashmap_uint32_t len, void *const value) {
-  hashmap_uint32_t index;
-
   if ((HASHMAP_NULL == key) || (0 == len)) {
     return 1;
   }
 
-  /* Find a place to put our value. */
-  while (!hashmap_hash_helper(m, key, len, &index)) {
-    if (hashmap_rehash_helper(m)) {
-      return 1;
-    }
-  }
-
-  /* Set the data. */
-  m->data[index].data = value;
-  m->data[index].key = key;
-  m->data[index].key_len = len;
-
-  /* If the hashmap element was not already in use, set that it is being used
-   * and bump our size. */
-  if (0 == m->data[index].in_use) {
-    m->data[index].in_use = 1;
-    m->size++;
-  }
-
-  return 0;
+  return hashmap_put_helper(m, key, len, m->hasher(~0u, key, len), value);
 }
 
 void *hashmap_get(const struct hashmap_s *const m, const void *const key,
                   const hashmap_uint32_t len) {
-  hashmap_uint32_t i, curr;
+  hashmap_uint32_t index;
+  struct hashmap_s old;
 
   if ((HASHMAP_NULL == key) || (0 == len)) {
     return HASHMAP_NULL;
   }
 
-  curr = hashmap_hash_helper_int_helper(m, key, len);
+  switch (hashmap_find_helper(m, &old, key, len, m->hasher(~0u, key, len),
+                              &index)) {
+  case 1:
+    return m->data[index].data;
+  case 2:
+    return old.data[index].data;
+  default:
+    /* Not found */
+    return HASHMAP_NULL;
+  }
+}
 
-  /* Linear probing, if necessary */
-  for (i = 0; i < HASHMAP_LINEAR_PROBE_LENGTH; i++) {
-    const hashmap_uint32_t index = curr + i;
+hashmap_uint32_t hashmap_get_batch(const struct hashmap_s *const m,
+                                   const void *const *const keys,
+                                   const hashmap_uint32_t *const lens,
+                                   const hashmap_uint32_t count,
+                                   void **const out_values) {
+  hashmap_uint32_t hashes[HASHMAP_BATCH_SIZE];
+  hashmap_uint32_t base, i, n, index;
+  hashmap_uint32_t found = 0;
+  struct hashmap_s old;
+
+  for (base = 0; base < count; base += n) {
+    n = count - base < HASHMAP_BATCH_SIZE ? count - base : HASHMAP_BATCH_SIZE;
+
+    for (i = 0; i < n; i++) {
+      if ((HASHMAP_NULL != keys[base + i]) && (0 != lens[base + i])) {
+        hashes[i] = m->hasher(~0u, keys[base + i], lens[base + i]);
+        hashmap_prefetch_helper(m, hashes[i]);
+      }
+    }
 
-    if (m->data[index].in_use) {
-      if (m->comparer(m->data[index].key, m->data[index].key_len, key, len)) {
-        return m->data[index].data;
+    for (i = 0; i < n; i++) {
+      if ((HASHMAP_NULL != keys[base + i]) && (0 != lens[base + i])) {
+        hashmap_prefetch_key_helper(m, hashes[i]);
+      }
+    }
+
+    for (i = 0; i < n; i++) {
+      out_values[base + i] = HASHMAP_NULL;
+
+      if ((HASHMAP_NULL == keys[base + i]) || (0 == lens[base + i])) {
+        continue;
+      }
+
+      switch (hashmap_find_helper(m, &old, keys[base + i], lens[base + i],
+                                  hashes[i], &index)) {
+      case 1:
+        out_values[base + i] = m->data[index].data;
+        found++;
+        break;
+      case 2:
+        out_values[base + i] = old.data[index].data;
+        found++;
+        break;
+      default:
+        break;
       }
     }
   }
 
-  /* Not found */
-  return HASHMAP_NULL;
+  return found;
 }
 
-int hashmap_remove(struct hashmap_s *const m, const void *const key,
-                   const hashmap_uint32_t len) {
-  hashmap_uint32_t i, curr;
+int hashmap_upsert_batch(struct hashmap_s *const m,
+                         const void *const *const keys,
+                         const hashmap_uint32_t *const lens,
+                         const hashmap_uint32_t count,
+                         void *const *const values) {
+  hashmap_uint32_t hashes[HASHMAP_BATCH_SIZE];
+  hashmap_uint32_t base, i, n;
+
+  for (base = 0; base < count; base += n) {
+    n = count - base < HASHMAP_BATCH_SIZE ? count - base : HASHMAP_BATCH_SIZE;
+
+    for (i = 0; i < n; i++) {
+      if ((HASHMAP_NULL != keys[base + i]) && (0 != lens[base + i])) {
+        hashes[i] = m->hasher(~0u, keys[base + i], lens[base + i]);
+        hashmap_prefetch_helper(m, hashes[i]);
+      }
+    }
 
-  if ((HASHMAP_NULL == key) || (0 == len)) {
-    return 1;
+    /* A put that grows the map leaves the rest of the prefetches stale, which
+     * only costs their misses. */
+    for (i = 0; i < n; i++) {
+      if ((HASHMAP_NULL == keys[base + i]) || (0 == lens[base + i]) ||
+          hashmap_put_helper(m, keys[base + i], lens[base + i], hashes[i],
+                             values[base + i])) {
+        return 1;
+      }
+    }
   }
 
-  curr = hashmap_hash_helper_int_helper(m, key, len);
+  return 0;
+}
+
+/* hashmap_put with the hash of the key already computed. */
+HASHMAP_ALWAYS_INLINE int hashmap_put_helper(struct hashmap_s *const m,
+                                             const void *const key,
+                                             const hashmap_uint32_t len,
+                                             const hashmap_uint32_t hash,
+                                             void *const value) {
+  hashmap_uint32_t index;
+  hashmap_uint32_t in_use;
+  struct hashmap_element_s element;
+  struct hashmap_s old;
+
+  if (HASHMAP_NULL != m->old_data) {
+    hashmap_rehash_step(m, HASHMAP_REHASH_STEP);
+  }
 
-  /* Linear probing, if necessary */
-  for (i = 0; i < HASHMAP_LINEAR_PROBE_LENGTH; i++) {
-    const hashmap_uint32_t index = curr + i;
+  if (hashmap_hash_helper(m, key, len, hash, &index, &in_use)) {
+    /* The key is already in the map, just replace the data. */
+    m->data[index].data = value;
+    m->data[index].key = key;
+    m->data[index].key_len = len;
+    return 0;
+  }
 
-    if (m->data[index].in_use) {
-      if (m->comparer(m->data[index].key, m->data[index].key_len, key, len)) {
-        /* Blank out the fields including in_use */
-        memset(&m->data[index], 0, sizeof(struct hashmap_element_s));
+  if (HASHMAP_NULL != m->old_data) {
+    hashmap_uint32_t old_index, old_in_use;
 
-        /* Reduce the size */
-        m->size--;
+    old = hashmap_old_table(m);
+    if (hashmap_hash_helper(&old, key, len, hash, &old_index, &old_in_use)) {
+      old.data[old_index].data = value;
+      old.data[old_index].key = key;
+      old.data[old_index].key_len = len;
+      return 0;
+    }
+  }
 
-        return 0;
-      }
+  /* Grow only for a new key, then find its place in the bigger table. */
+  if ((m->size + 1) * HASHMAP_MAX_LOAD_DENOMINATOR >
+      hashmap_capacity(m) * HASHMAP_MAX_LOAD_NUMERATOR) {
+    if (hashmap_rehash_helper(m)) {
+      return 1;
     }
+
+    hashmap_hash_helper(m, key, len, hash, &index, &in_use);
   }
 
-  return 1;
+  element.key = key;
+  element.key_len = len;
+  element.in_use = in_use;
+  element.hash = hash;
+  element.data = value;
+  hashmap_robin_hood_insert(m, index, element);
+  m->size++;
+
+  return 0;
+}
+
+int hashmap_remove(struct hashmap_s *const m, const void *const key,
+                   const hashmap_uint32_t len) {
+  return HASHMAP_NULL == hashmap_remove_and_return_key(m, key, len);
 }
 
 const void *hashmap_remove_and_return_key(struct hashmap_s *const m,
                                           const void *const key,
                                           const hashmap_uint32_t len) {
-  hashmap_uint32_t i, curr;
+  hashmap_uint32_t index;
+  struct hashmap_s old;
+  const void *stored_key;
 
   if ((HASHMAP_NULL == key) || (0 == len)) {
     return HASHMAP_NULL;
   }
 
-  curr = hashmap_hash_helper_int_helper(m, key, len);
-
-  /* Linear probing, if necessary */
-  for (i = 0; i < HASHMAP_LINEAR_PROBE_LENGTH; i++) {
-    const hashmap_uint32_t index = curr + i;
-
-    if (m->data[index].in_use) {
-      if (m->comparer(m->data[index].key, m->data[index].key_len, key, len)) {
-        const void *const stored_key = m->data[index].key;
-
-        /* Blank out the fields */
-        memset(&m->data[index], 0, sizeof(struct hashmap_element_s));
-
-        /* Reduce the size */
-        m->size--;
-
-        return stored_key;
-      }
-    }
+  if (HASHMAP_NULL != m->old_data) {
+    hashmap_rehash_step(m, HASHMAP_REHASH_STEP);
   }
 
-  return HASHMAP_NULL;
+  switch (hashmap_find_helper(m, &old, key, len, m->hasher(~0u, key, len),
+                              &index)) {
+  case 1:
+    stored_key = m->data[index].key;
+    hashmap_remove_at(m, index);
+    return stored_key;
+  case 2:
+    stored_key = old.data[index].key;
+    hashmap_remove_at(&old, index);
+    m->size--;
+    return stored_key;
+  default:
+    return HASHMAP_NULL;
+  }
 }
 
 int hashmap_iterate(const struct hashmap_s *const m,
                     int (*f)(void *const, void *const), void *const context) {
   hashmap_uint32_t i;
 
-  for (i = 0; i < (hashmap_capacity(m) + HASHMAP_LINEAR_PROBE_LENGTH); i++) {
+  if (HASHMAP_NULL != m->old_data) {
+    for (i = 0; i < (1u << m->old_log2_capacity); i++) {
+      if (m->old_data[i].in_use) {
+        if (!f(context, m->old_data[i].data)) {
+          return 1;
+        }
+      }
+    }
+  }
+
+  for (i = 0; i < hashmap_capacity(m); i++) {
     if (m->data[i].in_use) {
       if (!f(context, m->data[i].data)) {
         return 1;
@@ -470,22 +923,47 @@ int hashmap_iterate_pairs(struct hashmap_s *const m,
                           int (*f)(void *const,
                                    struct hashmap_element_s *const),
                           void *const context) {
-  hashmap_uint32_t i;
+  struct hashmap_s old;
+  int r;
+
+  if (HASHMAP_NULL != m->old_data) {
+    old = hashmap_old_table(m);
+    r = hashmap_iterate_pairs_helper(&old, f, context);
+    m->size = old.size;
+    if (0 != r) {
+      return r;
+    }
+  }
+
+  return hashmap_iterate_pairs_helper(m, f, context);
+}
+
+int hashmap_iterate_pairs_helper(struct hashmap_s *const m,
+                                 int (*f)(void *const,
+                                          struct hashmap_element_s *const),
+                                 void *const context) {
+  const hashmap_uint32_t mask = hashmap_capacity(m) - 1;
+  hashmap_uint32_t i, start, index;
   struct hashmap_element_s *p;
   int r;
 
-  for (i = 0; i < (hashmap_capacity(m) + HASHMAP_LINEAR_PROBE_LENGTH); i++) {
-    p = &m->data[i];
-    if (p->in_use) {
+  /* Removing an element shifts the rest of its run back by one slot. Starting
+   * right after a free slot no run wraps around past the start, so a shifted
+   * element always lands on a slot that is still to be visited, which is
+   * looked at again after a removal. */
+  for (start = 0; start < mask && m->data[start].in_use; start++) {
+  }
+
+  for (i = 1; i <= mask + 1; i++) {
+    index = (start + i) & mask;
+    p = &m->data[index];
+    while (p->in_use) {
       r = f(context, p);
-      switch (r) {
-      case -1: /* remove item */
-        memset(p, 0, sizeof(struct hashmap_element_s));
-        m->size--;
-        break;
-      case 0: /* continue iterating */
+      if (-1 == r) { /* remove item */
+        hashmap_remove_at(m, index);
+      } else if (0 == r) { /* continue iterating */
         break;
-      default: /* early exit */
+      } else { /* early exit */
         return 1;
       }
     }
@@ -495,6 +973,7 @@ int hashmap_iterate_pairs(struct hashmap_s *const m,
 
 void hashmap_destroy(struct hashmap_s *const m) {
   free(m->data);
+  free(m->old_data);
   memset(m, 0, sizeof(struct hashmap_s));
 }
 
@@ -508,6 +987,479 @@ hashmap_capacity(const struct hashmap_s *const m) {
   return 1u << m->log2_capacity;
 }
 
+HASHMAP_ALWAYS_INLINE hashmap_uint32_t
+hashmap_num_rehashes(const struct hashmap_s *const m) {
+  return m->rehashes;
+}
+
+int hashmap_sharded_create(const hashmap_uint32_t shards,
+                           struct hashmap_create_options_s options,
+                           struct hashmap_sharded_s *const out_hashmap) {
+  hashmap_uint32_t log2_shards = 0;
+  hashmap_uint32_t i;
+
+  while ((1u << log2_shards) < shards && log2_shards < 16) {
+    log2_shards++;
+  }
+
+  if (HASHMAP_NULL == options.hasher) {
+    options.hasher = &hashmap_crc32_hasher;
+  }
+  options.initial_capacity >>= log2_shards;
+
+  out_hashmap->log2_shards = log2_shards;
+  out_hashmap->hasher = options.hasher;
+  out_hashmap->shards = HASHMAP_CAST(
+      struct hashmap_shard_s *,
+      calloc(1u << log2_shards, sizeof(struct hashmap_shard_s)));
+
+  if (HASHMAP_NULL == out_hashmap->shards) {
+    return 1;
+  }
+
+  for (i = 0; i < (1u << log2_shards); i++) {
+    struct hashmap_shard_s *const shard = &out_hashmap->shards[i];
+
+    if (0 != hashmap_create_ex(options, &shard->map)) {
+      break;
+    }
+
+    if (0 != HASHMAP_LOCK_INIT(&shard->lock)) {
+      hashmap_destroy(&shard->map);
+      break;
+    }
+  }
+
+  if (i < (1u << log2_shards)) {
+    out_hashmap->log2_shards = 0;
+    while (0 < i--) {
+      hashmap_destroy(&out_hashmap->shards[i].map);
+      HASHMAP_LOCK_DESTROY(&out_hashmap->shards[i].lock);
+    }
+    free(out_hashmap->shards);
+    out_hashmap->shards = HASHMAP_NULL;
+    return 1;
+  }
+
+  return 0;
+}
+
+int hashmap_sharded_put(struct hashmap_sharded_s *const m,
+                        const void *const key, const hashmap_uint32_t len,
+                        void *const value) {
+  struct hashmap_shard_s *shard;
+  int result;
+
+  if ((HASHMAP_NULL == key) || (0 == len)) {
+    return 1;
+  }
+
+  shard = hashmap_shard_helper(m, key, len);
+
+  HASHMAP_LOCK(&shard->lock);
+  result = hashmap_put(&shard->map, key, len, value);
+  HASHMAP_UNLOCK(&shard->lock);
+
+  return result;
+}
+
+void *hashmap_sharded_get(struct hashmap_sharded_s *const m,
+                          const void *const key, const hashmap_uint32_t len) {
+  struct hashmap_shard_s *shard;
+  void *result;
+
+  if ((HASHMAP_NULL == key) || (0 == len)) {
+    return HASHMAP_NULL;
+  }
+
+  shard = hashmap_shard_helper(m, key, len);
+
+  HASHMAP_LOCK(&shard->lock);
+  result = hashmap_get(&shard->map, key, len);
+  HASHMAP_UNLOCK(&shard->lock);
+
+  return result;
+}
+
+int hashmap_sharded_remove(struct hashmap_sharded_s *const m,
+                           const void *const key, const hashmap_uint32_t len) {
+  struct hashmap_shard_s *shard;
+  int result;
+
+  if ((HASHMAP_NULL == key) || (0 == len)) {
+    return 1;
+  }
+
+  shard = hashmap_shard_helper(m, key, len);
+
+  HASHMAP_LOCK(&shard->lock);
+  result = hashmap_remove(&shard->map, key, len);
+  HASHMAP_UNLOCK(&shard->lock);
+
+  return result;
+}
+
+int hashmap_sharded_upsert_add(struct hashmap_sharded_s *const m,
+                               const void *const key,
+                               const hashmap_uint32_t len,
+                               const hashmap_int64_t delta) {
+  struct hashmap_shard_s *shard;
+  hashmap_int64_t *counter;
+  int result = 0;
+
+  if ((HASHMAP_NULL == key) || (0 == len)) {
+    return 1;
+  }
+
+  shard = hashmap_shard_helper(m, key, len);
+
+  HASHMAP_LOCK(&shard->lock);
+  counter = HASHMAP_PTR_CAST(hashmap_int64_t *,
+                             hashmap_get(&shard->map, key, len));
+
+  if (HASHMAP_NULL != counter) {
+    *counter += delta;
+  } else {
+    /* The counter and the copy of the key share one allocation. */
+    counter = HASHMAP_PTR_CAST(
+        hashmap_int64_t *,
+        hashmap_shard_alloc_helper(shard, sizeof(hashmap_int64_t) + len));
+
+    if (HASHMAP_NULL == counter) {
+      result = 1;
+    } else {
+      *counter = delta;
+      memcpy(counter + 1, key, len);
+      result = hashmap_put(&shard->map, counter + 1, len, counter);
+    }
+  }
+
+  HASHMAP_UNLOCK(&shard->lock);
+
+  return result;
+}
+
+int hashmap_sharded_iterate_pairs(
+    struct hashmap_sharded_s *const m,
+    int (*f)(void *const, struct hashmap_element_s *const),
+    void *const context) {
+  hashmap_uint32_t i;
+  int result = 0;
+
+  for (i = 0; i < (1u << m->log2_shards) && 0 == result; i++) {
+    struct hashmap_shard_s *const shard = &m->shards[i];
+
+    HASHMAP_LOCK(&shard->lock);
+    result = hashmap_iterate_pairs(&shard->map, f, context);
+    HASHMAP_UNLOCK(&shard->lock);
+  }
+
+  return result;
+}
+
+hashmap_uint32_t hashmap_sharded_num_entries(struct hashmap_sharded_s *const m) {
+  hashmap_uint32_t i;
+  hashmap_uint32_t size = 0;
+
+  for (i = 0; i < (1u << m->log2_shards); i++) {
+    struct hashmap_shard_s *const shard = &m->shards[i];
+
+    HASHMAP_LOCK(&shard->lock);
+    size += hashmap_num_entries(&shard->map);
+    HASHMAP_UNLOCK(&shard->lock);
+  }
+
+  return size;
+}
+
+void hashmap_sharded_destroy(struct hashmap_sharded_s *const m) {
+  hashmap_uint32_t i;
+
+  for (i = 0; HASHMAP_NULL != m->shards && i < (1u << m->log2_shards); i++) {
+    struct hashmap_shard_s *const shard = &m->shards[i];
+    struct hashmap_shard_block_s *block = shard->blocks;
+
+    while (HASHMAP_NULL != block) {
+      struct hashmap_shard_block_s *const next = block->next;
+      free(block);
+      block = next;
+    }
+
+    hashmap_destroy(&shard->map);
+    HASHMAP_LOCK_DESTROY(&shard->lock);
+  }
+
+  free(m->shards);
+  memset(m, 0, sizeof(struct hashmap_sharded_s));
+}
+
+int hashmap_snapshot_write(const struct hashmap_s *const m,
+                           const char *const path,
+                           hashmap_snapshot_value_t value,
+                           void *const context) {
+  struct hashmap_snapshot_header_s header;
+  struct hashmap_snapshot_slot_s *slots;
+  const struct hashmap_element_s **sources;
+  hashmap_uint64_t offset;
+  hashmap_uint32_t log2_capacity = 1;
+  hashmap_uint32_t i;
+  FILE *file = HASHMAP_NULL;
+  int result = 1;
+
+  while ((m->size * HASHMAP_MAX_LOAD_DENOMINATOR) >
+         ((1u << log2_capacity) * HASHMAP_MAX_LOAD_NUMERATOR)) {
+    log2_capacity++;
+  }
+
+  slots = HASHMAP_CAST(
+      struct hashmap_snapshot_slot_s *,
+      calloc(1u << log2_capacity, sizeof(struct hashmap_snapshot_slot_s)));
+  sources = HASHMAP_PTR_CAST(
+      const struct hashmap_element_s **,
+      calloc(1u << log2_capacity, sizeof(struct hashmap_element_s *)));
+
+  if ((HASHMAP_NULL == slots) || (HASHMAP_NULL == sources)) {
+    goto clean_up;
+  }
+
+  /* Both tables of an incremental rehash go into the one of the snapshot. */
+  for (i = 0; i < hashmap_capacity(m); i++) {
+    if (m->data[i].in_use) {
+      hashmap_snapshot_place(slots, sources, log2_capacity, &m->data[i]);
+    }
+  }
+
+  if (HASHMAP_NULL != m->old_data) {
+    for (i = 0; i < (1u << m->old_log2_capacity); i++) {
+      if (m->old_data[i].in_use) {
+        hashmap_snapshot_place(slots, sources, log2_capacity,
+                               &m->old_data[i]);
+      }
+    }
+  }
+
+  file = fopen(path, "wb");
+  if (HASHMAP_NULL == file) {
+    goto clean_up;
+  }
+
+  /* The header and the slots are written last, once the offsets are known. */
+  offset = sizeof(header) +
+           (HASHMAP_CAST(hashmap_uint64_t, 1) << log2_capacity) *
+               sizeof(struct hashmap_snapshot_slot_s);
+  if (0 != fseek(file, HASHMAP_CAST(long, offset), SEEK_SET)) {
+    goto clean_up;
+  }
+
+  /* The keys in slot order, so neighbouring slots have neighbouring keys. */
+  for (i = 0; i < (1u << log2_capacity); i++) {
+    if (slots[i].in_use) {
+      slots[i].key_offset = offset;
+      if (1 != fwrite(sources[i]->key, sources[i]->key_len, 1, file)) {
+        goto clean_up;
+      }
+      offset += sources[i]->key_len;
+    }
+  }
+
+  for (i = 0; i < (1u << log2_capacity); i++) {
+    const void *bytes = HASHMAP_NULL;
+    hashmap_uint32_t len = 0;
+
+    if (!slots[i].in_use) {
+      continue;
+    }
+
+    if ((HASHMAP_NULL != value) &&
+        (0 != value(context, sources[i]->data, &bytes, &len))) {
+      goto clean_up;
+    }
+
+    if (0 != hashmap_snapshot_pad(file, &offset)) {
+      goto clean_up;
+    }
+
+    slots[i].value_offset = offset;
+    slots[i].value_len = len;
+    if ((0 < len) && (1 != fwrite(bytes, len, 1, file))) {
+      goto clean_up;
+    }
+    offset += len;
+  }
+
+  if (0 != hashmap_snapshot_pad(file, &offset)) {
+    goto clean_up;
+  }
+
+  memset(&header, 0, sizeof(header));
+  header.magic = HASHMAP_SNAPSHOT_MAGIC;
+  header.version = HASHMAP_SNAPSHOT_VERSION;
+  header.log2_capacity = log2_capacity;
+  header.size = m->size;
+  header.probe_hash = m->hasher(~0u, "hashmap", 7);
+  header.file_size = offset;
+
+  if ((0 != fseek(file, 0, SEEK_SET)) ||
+      (1 != fwrite(&header, sizeof(header), 1, file)) ||
+      ((1u << log2_capacity) !=
+       fwrite(slots, sizeof(struct hashmap_snapshot_slot_s),
+              1u << log2_capacity, file))) {
+    goto clean_up;
+  }
+
+  result = 0;
+
+clean_up:
+  if (HASHMAP_NULL != file && 0 != fclose(file)) {
+    result = 1;
+  }
+
+  if (0 != result && HASHMAP_NULL != file) {
+    remove(path);
+  }
+
+  free(slots);
+  free(sources);
+
+  return result;
+}
+
+int hashmap_snapshot_view(const void *const bytes, const hashmap_uint64_t size,
+                          struct hashmap_create_options_s options,
+                          struct hashmap_snapshot_s *const out_snapshot) {
+  const struct hashmap_snapshot_header_s *const header =
+      HASHMAP_PTR_CAST(const struct hashmap_snapshot_header_s *, bytes);
+
+  if (HASHMAP_NULL == options.hasher) {
+    options.hasher = &hashmap_crc32_hasher;
+  }
+
+  if (HASHMAP_NULL == options.comparer) {
+    options.comparer = &hashmap_memcmp_comparer;
+  }
+
+  /* Only the header is checked here, the offsets of a slot are checked when a
+   * lookup reaches it. */
+  if ((size < sizeof(*header)) || (HASHMAP_SNAPSHOT_MAGIC != header->magic) ||
+      (HASHMAP_SNAPSHOT_VERSION != header->version) ||
+      (1 > header->log2_capacity) || (31 < header->log2_capacity) ||
+      (size < header->file_size) || (sizeof(*header) > header->file_size) ||
+      ((header->file_size - sizeof(*header)) /
+           sizeof(struct hashmap_snapshot_slot_s) <
+       (HASHMAP_CAST(hashmap_uint64_t, 1) << header->log2_capacity)) ||
+      (options.hasher(~0u, "hashmap", 7) != header->probe_hash)) {
+    return 1;
+  }
+
+  out_snapshot->bytes = HASHMAP_PTR_CAST(const hashmap_uint8_t *, bytes);
+  out_snapshot->header = header;
+  out_snapshot->slots = HASHMAP_PTR_CAST(const struct hashmap_snapshot_slot_s *,
+                                         header + 1);
+  out_snapshot->hasher = options.hasher;
+  out_snapshot->comparer = options.comparer;
+  out_snapshot->mapping = HASHMAP_NULL;
+  out_snapshot->mapping_size = 0;
+
+  return 0;
+}
+
+#if !defined(_WIN32)
+int hashmap_snapshot_open(const char *const path,
+                          struct hashmap_create_options_s options,
+                          struct hashmap_snapshot_s *const out_snapshot) {
+  struct stat file_stat;
+  void *mapping;
+  int fd = open(path, O_RDONLY);
+
+  if (0 > fd) {
+    return 1;
+  }
+
+  if ((0 != fstat(fd, &file_stat)) || (0 == file_stat.st_size)) {
+    close(fd);
+    return 1;
+  }
+
+  mapping = mmap(HASHMAP_NULL, HASHMAP_CAST(size_t, file_stat.st_size),
+                 PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (MAP_FAILED == mapping) {
+    return 1;
+  }
+
+  if (0 != hashmap_snapshot_view(
+               mapping, HASHMAP_CAST(hashmap_uint64_t, file_stat.st_size),
+               options, out_snapshot)) {
+    munmap(mapping, HASHMAP_CAST(size_t, file_stat.st_size));
+    return 1;
+  }
+
+  out_snapshot->mapping = mapping;
+  out_snapshot->mapping_size =
+      HASHMAP_CAST(hashmap_uint64_t, file_stat.st_size);
+
+  return 0;
+}
+#endif
+
+const void *hashmap_snapshot_get(const struct hashmap_snapshot_s *const s,
+                                 const void *const key,
+                                 const hashmap_uint32_t len,
+                                 hashmap_uint32_t *const out_len) {
+  const hashmap_uint64_t file_size = s->header->file_size;
+  const hashmap_uint32_t mask = (1u << s->header->log2_capacity) - 1;
+  hashmap_uint32_t hash, index, in_use;
+
+  if ((HASHMAP_NULL == key) || (0 == len)) {
+    return HASHMAP_NULL;
+  }
+
+  hash = s->hasher(~0u, key, len);
+  index = (hash * 2654435769u) >> (32u - s->header->log2_capacity);
+
+  /* The same robin-hood walk as hashmap_hash_helper. The in_use values come
+   * from the file, so the walk also stops after visiting every slot once. */
+  for (in_use = 1; (in_use <= s->slots[index].in_use) && (in_use <= mask + 1);
+       index = (index + 1) & mask, in_use++) {
+    const struct hashmap_snapshot_slot_s *const slot = &s->slots[index];
+
+    if ((slot->in_use != in_use) || (slot->hash != hash) ||
+        (slot->key_offset > file_size) ||
+        (slot->key_len > file_size - slot->key_offset) ||
+        !s->comparer(s->bytes + slot->key_offset, slot->key_len, key, len)) {
+      continue;
+    }
+
+    if ((slot->value_offset > file_size) ||
+        (slot->value_len > file_size - slot->value_offset)) {
+      return HASHMAP_NULL;
+    }
+
+    if (HASHMAP_NULL != out_len) {
+      *out_len = slot->value_len;
+    }
+    return s->bytes + slot->value_offset;
+  }
+
+  return HASHMAP_NULL;
+}
+
+hashmap_uint32_t
+hashmap_snapshot_num_entries(const struct hashmap_snapshot_s *const s) {
+  return s->header->size;
+}
+
+void hashmap_snapshot_close(struct hashmap_snapshot_s *const s) {
+#if !defined(_WIN32)
+  if (HASHMAP_NULL != s->mapping) {
+    munmap(s->mapping, HASHMAP_CAST(size_t, s->mapping_size));
+  }
+#endif
+
+  memset(s, 0, sizeof(struct hashmap_snapshot_s));
+}
+
 hashmap_uint32_t hashmap_crc32_hasher(const hashmap_uint32_t seed,
                                       const void *const k,
                                       const hashmap_uint32_t len) {
@@ -609,100 +1561,361 @@ hashmap_uint32_t hashmap_crc32_hasher(const hashmap_uint32_t seed,
   return crc32val;
 }
 
+/*
+ * wyhash (final version 4) by Wang Yi, folded to 32 bits. It reads the key 16
+ * or 48 bytes at a time and mixes with 64x64->128 bit multiplies, so it keeps
+ * up with the crc32 instruction on short keys and overtakes it on long ones.
+ */
+hashmap_uint32_t hashmap_wyhash_hasher(const hashmap_uint32_t seed,
+                                       const void *const k,
+                                       const hashmap_uint32_t len) {
+  static const hashmap_uint64_t secret[4] = {
+      0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull,
+      0x4d5a2da51de1aa47ull};
+  const hashmap_uint8_t *p = HASHMAP_PTR_CAST(const hashmap_uint8_t *, k);
+  hashmap_uint64_t state =
+      seed ^ hashmap_wyhash_mix(seed ^ secret[0], secret[1]);
+  hashmap_uint64_t a, b, hash;
+  hashmap_uint32_t i = len;
+
+  if (16 >= len) {
+    if (4 <= len) {
+      a = (hashmap_wyhash_read(p, 4) << 32) |
+          hashmap_wyhash_read(p + ((len >> 3) << 2), 4);
+      b = (hashmap_wyhash_read(p + len - 4, 4) << 32) |
+          hashmap_wyhash_read(p + len - 4 - ((len >> 3) << 2), 4);
+    } else if (0 < len) {
+      a = (HASHMAP_CAST(hashmap_uint64_t, p[0]) << 16) |
+          (HASHMAP_CAST(hashmap_uint64_t, p[len >> 1]) << 8) | p[len - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    if (48 <= i) {
+      hashmap_uint64_t state1 = state, state2 = state;
+
+      do {
+        state = hashmap_wyhash_mix(hashmap_wyhash_read(p, 8) ^ secret[1],
+                                   hashmap_wyhash_read(p + 8, 8) ^ state);
+        state1 = hashmap_wyhash_mix(hashmap_wyhash_read(p + 16, 8) ^ secret[2],
+                                    hashmap_wyhash_read(p + 24, 8) ^ state1);
+        state2 = hashmap_wyhash_mix(hashmap_wyhash_read(p + 32, 8) ^ secret[3],
+                                    hashmap_wyhash_read(p + 40, 8) ^ state2);
+        p += 48;
+        i -= 48;
+      } while (48 <= i);
+
+      state ^= state1 ^ state2;
+    }
+
+    while (16 < i) {
+      state = hashmap_wyhash_mix(hashmap_wyhash_read(p, 8) ^ secret[1],
+                                 hashmap_wyhash_read(p + 8, 8) ^ state);
+      p += 16;
+      i -= 16;
+    }
+
+    a = hashmap_wyhash_read(p + i - 16, 8);
+    b = hashmap_wyhash_read(p + i - 8, 8);
+  }
+
+  a ^= secret[1];
+  b ^= state;
+  hashmap_wyhash_mum(&a, &b);
+  hash = hashmap_wyhash_mix(a ^ secret[0] ^ len, b ^ secret[1]);
+
+  return HASHMAP_CAST(hashmap_uint32_t, hash ^ (hash >> 32));
+}
+
 int hashmap_memcmp_comparer(const void *const a, const hashmap_uint32_t a_len,
                             const void *const b, const hashmap_uint32_t b_len) {
   return (a_len == b_len) && (0 == memcmp(a, b, a_len));
 }
 
-HASHMAP_ALWAYS_INLINE hashmap_uint32_t
-hashmap_hash_helper_int_helper(const struct hashmap_s *const m,
-                               const void *const k, const hashmap_uint32_t l) {
-  return (m->hasher(~0u, k, l) * 2654435769u) >> (32u - m->log2_capacity);
+/* Replaces a and b with the low and the high half of their 128 bit product. */
+HASHMAP_ALWAYS_INLINE void hashmap_wyhash_mum(hashmap_uint64_t *const a,
+                                              hashmap_uint64_t *const b) {
+#if defined(__SIZEOF_INT128__)
+  const __uint128_t product = HASHMAP_CAST(__uint128_t, *a) * *b;
+  *a = HASHMAP_CAST(hashmap_uint64_t, product);
+  *b = HASHMAP_CAST(hashmap_uint64_t, product >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+  *a = _umul128(*a, *b, b);
+#else
+  const hashmap_uint64_t a_high = *a >> 32, a_low = *a & 0xffffffffu;
+  const hashmap_uint64_t b_high = *b >> 32, b_low = *b & 0xffffffffu;
+  const hashmap_uint64_t low_low = a_low * b_low, high_low = a_high * b_low;
+  const hashmap_uint64_t low_high = a_low * b_high, high_high = a_high * b_high;
+  const hashmap_uint64_t middle =
+      (low_low >> 32) + (high_low & 0xffffffffu) + low_high;
+  *a = (middle << 32) | (low_low & 0xffffffffu);
+  *b = high_high + (high_low >> 32) + (middle >> 32);
+#endif
 }
 
-HASHMAP_ALWAYS_INLINE int
-hashmap_hash_helper(const struct hashmap_s *const m, const void *const key,
-                    const hashmap_uint32_t len,
-                    hashmap_uint32_t *const out_index) {
-  hashmap_uint32_t curr;
-  hashmap_uint32_t i;
-  hashmap_uint32_t first_free;
+/* The low half of the 128 bit product of a and b xor its high half. */
+HASHMAP_ALWAYS_INLINE hashmap_uint64_t hashmap_wyhash_mix(hashmap_uint64_t a,
+                                                         hashmap_uint64_t b) {
+  hashmap_wyhash_mum(&a, &b);
+  return a ^ b;
+}
 
-  /* If full, return immediately */
-  if (hashmap_num_entries(m) == hashmap_capacity(m)) {
-    return 0;
+/* n = 4 or 8 bytes as a little endian number. */
+HASHMAP_ALWAYS_INLINE hashmap_uint64_t
+hashmap_wyhash_read(const hashmap_uint8_t *const p, const hashmap_uint32_t n) {
+  hashmap_uint64_t value;
+
+  if (4 == n) {
+    hashmap_uint32_t value32;
+    memcpy(&value32, p, sizeof(value32));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value32 = __builtin_bswap32(value32);
+#endif
+    return value32;
   }
 
-  /* Find the best index */
-  curr = hashmap_hash_helper_int_helper(m, key, len);
-  first_free = ~0u;
+  memcpy(&value, p, sizeof(value));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  value = __builtin_bswap64(value);
+#endif
+  return value;
+}
 
-  for (i = 0; i < HASHMAP_LINEAR_PROBE_LENGTH; i++) {
-    const hashmap_uint32_t index = curr + i;
+HASHMAP_ALWAYS_INLINE hashmap_uint32_t hashmap_hash_helper_int_helper(
+    const struct hashmap_s *const m, const hashmap_uint32_t hash) {
+  return (hash * 2654435769u) >> (32u - m->log2_capacity);
+}
+
+/*
+ * Robin-hood lookup: the elements of a run are ordered by their distance from
+ * their home slot, so the probe can stop at the first free slot or at the first
+ * element that is closer to home than the key would be at that slot. Only
+ * elements with the same stored hash have their keys compared. Returns 1 with
+ * the index of the key, or 0 with the slot the key would be inserted at and
+ * its in_use value there.
+ */
+HASHMAP_ALWAYS_INLINE int
+hashmap_hash_helper(const struct hashmap_s *const m, const void *const key,
+                    const hashmap_uint32_t len, const hashmap_uint32_t hash,
+                    hashmap_uint32_t *const out_index,
+                    hashmap_uint32_t *const out_in_use) {
+  const hashmap_uint32_t mask = hashmap_capacity(m) - 1;
+  hashmap_uint32_t index = hashmap_hash_helper_int_helper(m, hash);
+  hashmap_uint32_t in_use = 1;
+
+  for (;; index = (index + 1) & mask, in_use++) {
+    const struct hashmap_element_s *const e = &m->data[index];
+
+    if (e->in_use < in_use) {
+      break;
+    }
 
-    if (!m->data[index].in_use) {
-      first_free = (first_free < index) ? first_free : index;
-    } else if (m->comparer(m->data[index].key, m->data[index].key_len, key,
-                           len)) {
+    if (e->in_use == in_use && e->hash == hash &&
+        m->comparer(e->key, e->key_len, key, len)) {
       *out_index = index;
       return 1;
     }
   }
 
-  // Couldn't find a free element in the linear probe.
-  if (~0u == first_free) {
-    return 0;
+  *out_index = index;
+  *out_in_use = in_use;
+  return 0;
+}
+
+/* Starts loading the home slot of the hash, and that of the table being
+ * drained, into the cache. */
+HASHMAP_ALWAYS_INLINE void
+hashmap_prefetch_helper(const struct hashmap_s *const m,
+                        const hashmap_uint32_t hash) {
+  HASHMAP_PREFETCH(&m->data[hashmap_hash_helper_int_helper(m, hash)]);
+
+  if (HASHMAP_NULL != m->old_data) {
+    HASHMAP_PREFETCH(&m->old_data[(hash * 2654435769u) >>
+                                  (32u - m->old_log2_capacity)]);
+  }
+}
+
+/* Once the slots have arrived, starts loading the stored key of the first
+ * element of the run whose hash matches, which the lookup compares with. */
+HASHMAP_ALWAYS_INLINE void
+hashmap_prefetch_key_helper(const struct hashmap_s *const m,
+                            const hashmap_uint32_t hash) {
+  const hashmap_uint32_t mask = hashmap_capacity(m) - 1;
+  hashmap_uint32_t index = hashmap_hash_helper_int_helper(m, hash);
+  hashmap_uint32_t in_use = 1;
+
+  for (; in_use <= m->data[index].in_use;
+       index = (index + 1) & mask, in_use++) {
+    if (m->data[index].hash == hash) {
+      HASHMAP_PREFETCH(m->data[index].key);
+      return;
+    }
+  }
+}
+
+/* Puts the element at index, pushing the richer elements it displaces further
+ * along their runs. */
+HASHMAP_ALWAYS_INLINE void
+hashmap_robin_hood_insert(struct hashmap_s *const m, hashmap_uint32_t index,
+                          struct hashmap_element_s element) {
+  const hashmap_uint32_t mask = hashmap_capacity(m) - 1;
+
+  for (;; index = (index + 1) & mask, element.in_use++) {
+    struct hashmap_element_s *const e = &m->data[index];
+
+    if (!e->in_use) {
+      *e = element;
+      return;
+    }
+
+    if (e->in_use < element.in_use) {
+      const struct hashmap_element_s displaced = *e;
+      *e = element;
+      element = displaced;
+    }
+  }
+}
+
+/* Backward-shift deletion: the rest of the run moves one slot closer to home,
+ * so no tombstones are left behind. */
+HASHMAP_ALWAYS_INLINE void hashmap_remove_at(struct hashmap_s *const m,
+                                             hashmap_uint32_t index) {
+  const hashmap_uint32_t mask = hashmap_capacity(m) - 1;
+  hashmap_uint32_t next = (index + 1) & mask;
+
+  while (m->data[next].in_use > 1) {
+    m->data[index] = m->data[next];
+    m->data[index].in_use--;
+    index = next;
+    next = (next + 1) & mask;
   }
 
-  *out_index = first_free;
-  return 1;
+  memset(&m->data[index], 0, sizeof(struct hashmap_element_s));
+  m->size--;
 }
 
-int hashmap_rehash_iterator(void *const new_hash,
-                            struct hashmap_element_s *const e) {
-  int temp = hashmap_put(HASHMAP_PTR_CAST(struct hashmap_s *, new_hash), e->key,
-                         e->key_len, e->data);
+/* The table being drained, as a map of its own. Its size is only meaningful
+ * for counting removals. */
+HASHMAP_ALWAYS_INLINE struct hashmap_s
+hashmap_old_table(const struct hashmap_s *const m) {
+  struct hashmap_s old = *m;
+  old.data = m->old_data;
+  old.log2_capacity = m->old_log2_capacity;
+  old.old_data = HASHMAP_NULL;
+  return old;
+}
 
-  if (0 < temp) {
+/* Returns 1 when the key is at index in m, 2 when it is at index in the table
+ * being drained, which is then put in old, and 0 when it isn't there. */
+HASHMAP_ALWAYS_INLINE int hashmap_find_helper(const struct hashmap_s *const m,
+                                              struct hashmap_s *const old,
+                                              const void *const key,
+                                              const hashmap_uint32_t len,
+                                              const hashmap_uint32_t hash,
+                                              hashmap_uint32_t *const out_index) {
+  hashmap_uint32_t in_use;
+
+  if (hashmap_hash_helper(m, key, len, hash, out_index, &in_use)) {
     return 1;
   }
 
-  /* clear old value to avoid stale pointers */
-  return -1;
+  if (HASHMAP_NULL != m->old_data) {
+    *old = hashmap_old_table(m);
+    if (hashmap_hash_helper(old, key, len, hash, out_index, &in_use)) {
+      return 2;
+    }
+  }
+
+  return 0;
+}
+
+/* Moves the elements of the next slots of the old table into the new one. A
+ * slot is emptied by removing its element until the backward shift leaves it
+ * free, and as the walk started after a free slot nothing is ever shifted
+ * into a slot that is done. */
+HASHMAP_ALWAYS_INLINE void hashmap_rehash_step(struct hashmap_s *const m,
+                                               hashmap_uint32_t slots) {
+  struct hashmap_s old = hashmap_old_table(m);
+  const hashmap_uint32_t mask = hashmap_capacity(&old) - 1;
+
+  for (; 0 < slots && m->old_next <= mask; slots--) {
+    const hashmap_uint32_t index = (m->old_start + ++m->old_next) & mask;
+
+    while (old.data[index].in_use) {
+      struct hashmap_element_s element = old.data[index];
+      element.in_use = 1;
+      hashmap_robin_hood_insert(
+          m, hashmap_hash_helper_int_helper(m, element.hash), element);
+      hashmap_remove_at(&old, index);
+    }
+  }
+
+  if (m->old_next > mask) {
+    free(m->old_data);
+    m->old_data = HASHMAP_NULL;
+  }
 }
 
 /*
- * Doubles the size of the hashmap, and rehashes all the elements
+ * Doubles the size of the hashmap, and rehashes all the elements, or with
+ * HASHMAP_INCREMENTAL_REHASH only sets the old table aside to be drained.
  */
 HASHMAP_ALWAYS_INLINE int hashmap_rehash_helper(struct hashmap_s *const m) {
   struct hashmap_create_options_s options;
   struct hashmap_s new_m;
+  hashmap_uint32_t i;
   int flag;
 
   memset(&options, 0, sizeof(options));
   options.initial_capacity = hashmap_capacity(m) * 2;
   options.hasher = m->hasher;
   options.comparer = m->comparer;
+  options.flags = m->flags;
 
   if (0 == options.initial_capacity) {
     return 1;
   }
 
+  /* A rehash still running when the next one is due is finished at once. */
+  if (HASHMAP_NULL != m->old_data) {
+    hashmap_rehash_step(m, ~0u);
+  }
+
   flag = hashmap_create_ex(options, &new_m);
 
   if (0 != flag) {
     return flag;
   }
 
-  /* copy the old elements to the new table */
-  flag = hashmap_iterate_pairs(m, hashmap_rehash_iterator,
-                               HASHMAP_PTR_CAST(void *, &new_m));
+  new_m.size = m->size;
+  new_m.rehashes = m->rehashes + 1;
 
-  if (0 != flag) {
-    return flag;
+  if (m->flags & HASHMAP_INCREMENTAL_REHASH) {
+    new_m.old_data = m->data;
+    new_m.old_log2_capacity = m->log2_capacity;
+    for (i = 0; m->data[i].in_use; i++) {
+    }
+    new_m.old_start = i;
+    new_m.old_next = 0;
+    memcpy(m, &new_m, sizeof(struct hashmap_s));
+    return 0;
   }
 
-  hashmap_destroy(m);
+  /* The keys are known to be distinct and their hashes are stored, each goes
+   * straight to its place without being read. */
+  for (i = 0; i < hashmap_capacity(m); i++) {
+    struct hashmap_element_s element = m->data[i];
+
+    if (element.in_use) {
+      element.in_use = 1;
+      hashmap_robin_hood_insert(
+          &new_m, hashmap_hash_helper_int_helper(&new_m, element.hash),
+          element);
+    }
+  }
+
+  free(m->data);
 
   /* put new hash into old hash structure by copying */
   memcpy(m, &new_m, sizeof(struct hashmap_s));
@@ -710,6 +1923,94 @@ HASHMAP_ALWAYS_INLINE int hashmap_rehash_helper(struct hashmap_s *const m) {
   return 0;
 }
 
+/* The shard comes from the low bits of the hash, the slot in the shard from the
+ * high bits of its product with the golden ratio, so the two don't correlate. */
+HASHMAP_ALWAYS_INLINE struct hashmap_shard_s *
+hashmap_shard_helper(const struct hashmap_sharded_s *const m,
+                     const void *const key, const hashmap_uint32_t len) {
+  const hashmap_uint32_t mask = (1u << m->log2_shards) - 1;
+  return &m->shards[m->hasher(~0u, key, len) & mask];
+}
+
+/* Bump allocation from the blocks of the shard, called with its lock held. */
+HASHMAP_ALWAYS_INLINE void *
+hashmap_shard_alloc_helper(struct hashmap_shard_s *const shard,
+                           const hashmap_uint32_t size) {
+  const hashmap_uint32_t aligned = (size + 7u) & ~7u;
+  const hashmap_uint32_t header =
+      (sizeof(struct hashmap_shard_block_s) + 7u) & ~7u;
+  struct hashmap_shard_block_s *block = shard->blocks;
+  void *allocated;
+
+  if (HASHMAP_NULL == block || block->size - block->used < aligned) {
+    const hashmap_uint32_t block_size =
+        aligned > HASHMAP_SHARD_BLOCK_SIZE ? aligned : HASHMAP_SHARD_BLOCK_SIZE;
+
+    block = HASHMAP_PTR_CAST(struct hashmap_shard_block_s *,
+                             malloc(header + block_size));
+    if (HASHMAP_NULL == block) {
+      return HASHMAP_NULL;
+    }
+
+    block->next = shard->blocks;
+    block->used = 0;
+    block->size = block_size;
+    shard->blocks = block;
+  }
+
+  allocated = HASHMAP_PTR_CAST(char *, block) + header + block->used;
+  block->used += aligned;
+  return allocated;
+}
+
+/* Robin-hood insert of an element into the slots of a snapshot being written,
+ * the source element of a slot moves along with it. */
+HASHMAP_ALWAYS_INLINE void
+hashmap_snapshot_place(struct hashmap_snapshot_slot_s *const slots,
+                       const struct hashmap_element_s **const sources,
+                       const hashmap_uint32_t log2_capacity,
+                       const struct hashmap_element_s *source) {
+  const hashmap_uint32_t mask = (1u << log2_capacity) - 1;
+  struct hashmap_snapshot_slot_s slot;
+  hashmap_uint32_t index =
+      (source->hash * 2654435769u) >> (32u - log2_capacity);
+
+  memset(&slot, 0, sizeof(slot));
+  slot.key_len = source->key_len;
+  slot.hash = source->hash;
+
+  for (slot.in_use = 1;; index = (index + 1) & mask, slot.in_use++) {
+    if (!slots[index].in_use) {
+      slots[index] = slot;
+      sources[index] = source;
+      return;
+    }
+
+    if (slots[index].in_use < slot.in_use) {
+      const struct hashmap_snapshot_slot_s displaced = slots[index];
+      const struct hashmap_element_s *const displaced_source = sources[index];
+      slots[index] = slot;
+      sources[index] = source;
+      slot = displaced;
+      source = displaced_source;
+    }
+  }
+}
+
+/* Writes zeros up to the next multiple of 8 bytes. */
+HASHMAP_ALWAYS_INLINE int hashmap_snapshot_pad(FILE *const file,
+                                               hashmap_uint64_t *const offset) {
+  static const hashmap_uint8_t zeros[8] = {0};
+  const hashmap_uint64_t padding = (8 - (*offset & 7)) & 7;
+
+  if ((0 < padding) && (1 != fwrite(zeros, padding, 1, file))) {
+    return 1;
+  }
+
+  *offset += padding;
+  return 0;
+}
+
 HASHMAP_ALWAYS_INLINE hashmap_uint32_t hashmap_clz(const hashmap_uint32_t x) {
 #if defined(_MSC_VER)
   unsigned long result;
@@ -0,0 +1,298 @@
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/*
+ * Writes synthetic access logs in the combined log format for benchmarking
+ * the analyzer. URLs and referers are drawn from a Zipf distribution over a
+ * configurable number of distinct values, so the skew that decides how hot
+ * the hashmaps get can be dialed in; a share of the lines can be made
+ * malformed to exercise the parser's error paths. The same seed always gives
+ * the same files.
+ */
+#define DEFAULT_SIZE ((uint64_t)256 * 1024 * 1024)
+#define DEFAULT_FILES 4
+#define DEFAULT_URLS 100000
+#define DEFAULT_REFERERS 1000
+#define DEFAULT_ZIPF 1.0
+#define DEFAULT_SEED 1
+#define WRITE_BUFFER_SIZE (1024 * 1024)
+
+struct gen_options {
+	uint64_t size;
+	unsigned int files;
+	unsigned int urls;
+	unsigned int referers;
+	double zipf;
+	double malformed;
+	uint64_t seed;
+};
+
+// xorshift64*, good enough for test data and the same on every platform
+static uint64_t next_random(uint64_t* state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+// uniform in [0, 1)
+static double next_unit(uint64_t* state) {
+	return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// cumulative probabilities of ranks 1..n under Zipf with exponent s
+static double* zipf_table(unsigned int n, double s) {
+	double* cdf = malloc(sizeof(double) * n);
+	if (cdf == NULL) {
+		return NULL;
+	}
+
+	double sum = 0;
+	for (unsigned int i = 0; i < n; i++) {
+		sum += 1.0 / pow(i + 1, s);
+		cdf[i] = sum;
+	}
+
+	for (unsigned int i = 0; i < n; i++) {
+		cdf[i] /= sum;
+	}
+
+	return cdf;
+}
+
+// 0-based rank drawn from the table
+static unsigned int zipf_draw(const double* cdf, unsigned int n, uint64_t* state) {
+	double u = next_unit(state);
+	unsigned int low = 0;
+	unsigned int high = n - 1;
+	while (low < high) {
+		unsigned int middle = low + (high - low) / 2;
+		if (cdf[middle] < u) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+
+	return low;
+}
+
+static const char* const methods[] = { "GET", "GET", "GET", "GET", "POST", "HEAD" };
+static const int statuses[] = { 200, 200, 200, 200, 200, 200, 200, 304, 404, 500 };
+static const char* const user_agents[] = {
+	"Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0",
+	"Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36",
+	"Mozilla/5.0 (iPhone; CPU iPhone OS 17_1 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Mobile/15E148",
+	"curl/8.4.0",
+	"Googlebot/2.1 (+http://www.google.com/bot.html)",
+};
+static const char* const months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+#define COUNT_OF(array) (sizeof(array) / sizeof(array[0]))
+
+// the line for the given second of the log, returns its length
+static int format_line(char* line, size_t capacity, uint64_t second, const struct gen_options* options,
+                       const double* url_cdf, const double* referer_cdf, uint64_t* state) {
+	// a line per second from 2000-01-01, months of 28 days keep the arithmetic simple
+	unsigned int day = 1 + (unsigned int)(second / 86400) % 28;
+	unsigned int month = (unsigned int)(second / (86400 * 28)) % 12;
+	unsigned int year = 2000 + (unsigned int)(second / (86400 * 28 * 12));
+	unsigned int of_day = (unsigned int)(second % 86400);
+	uint64_t random = next_random(state);
+
+	unsigned int url = zipf_draw(url_cdf, options->urls, state);
+	unsigned int referer = zipf_draw(referer_cdf, options->referers, state);
+	int len = snprintf(line, capacity,
+		"10.%u.%u.%u - - [%02u/%s/%u:%02u:%02u:%02u +0000] \"%s /item/%u HTTP/1.1\" %d %u \"https://ref%u.example.com/\" \"%s\"\n",
+		(unsigned int)(random >> 8) & 255, (unsigned int)(random >> 16) & 255, (unsigned int)(random >> 24) & 255,
+		day, months[month], year, of_day / 3600, of_day / 60 % 60, of_day % 60,
+		methods[random % COUNT_OF(methods)], url, statuses[(random >> 32) % COUNT_OF(statuses)],
+		(unsigned int)(random >> 40) % 100000, referer, user_agents[(random >> 56) % COUNT_OF(user_agents)]);
+
+	if (options->malformed > 0 && next_unit(state) < options->malformed) {
+		switch (next_random(state) % 3) {
+		case 0:
+			// cut short in the middle of the request
+			len = len / 2;
+			line[len++] = '\n';
+			break;
+		case 1:
+			// the request loses its opening quote
+			*strchr(line, '"') = ' ';
+			break;
+		default:
+			len = snprintf(line, capacity, "%016llx garbage line\n", (unsigned long long)random);
+			break;
+		}
+	}
+
+	return len;
+}
+
+static int write_logs(const char* dir, const struct gen_options* options) {
+	int exit_code = 0;
+	double* url_cdf = zipf_table(options->urls, options->zipf);
+	double* referer_cdf = zipf_table(options->referers, options->zipf);
+	char* buffer = malloc(WRITE_BUFFER_SIZE);
+	if (url_cdf == NULL || referer_cdf == NULL || buffer == NULL) {
+		printf("failed to allocate memory\n");
+		exit_code = -1;
+		goto clean_up;
+	}
+
+	uint64_t state = options->seed != 0 ? options->seed : DEFAULT_SEED;
+	uint64_t second = 0;
+	uint64_t file_size = options->size / options->files;
+	char path[4096];
+	for (unsigned int i = 0; i < options->files && exit_code == 0; i++) {
+		snprintf(path, sizeof(path), "%s/access%u.log", dir, i);
+		FILE* file = fopen(path, "w");
+		if (file == NULL) {
+			perror("failed to open the output file");
+			exit_code = -1;
+			break;
+		}
+		setvbuf(file, buffer, _IOFBF, WRITE_BUFFER_SIZE);
+
+		for (uint64_t written = 0; written < file_size; second++) {
+			char line[1024];
+			int len = format_line(line, sizeof(line), second, options, url_cdf, referer_cdf, &state);
+			if (fwrite(line, 1, len, file) != (size_t)len) {
+				perror("failed to write the output file");
+				exit_code = -1;
+				break;
+			}
+			written += len;
+		}
+
+		if (fclose(file) != 0) {
+			perror("failed to close the output file");
+			exit_code = -1;
+		}
+	}
+
+	clean_up:
+	free(url_cdf);
+	free(referer_cdf);
+	free(buffer);
+	return exit_code;
+}
+
+// "512M" -> bytes
+static int parse_size(const char* text, uint64_t* size) {
+	char* end;
+	double value = strtod(text, &end);
+	if (end == text || value <= 0) {
+		return -1;
+	}
+
+	switch (*end) {
+	case 'g': case 'G':
+		value *= 1024;
+		// fall through
+	case 'm': case 'M':
+		value *= 1024;
+		// fall through
+	case 'k': case 'K':
+		value *= 1024;
+		end++;
+		break;
+	}
+
+	if (*end != '\0') {
+		return -1;
+	}
+
+	*size = (uint64_t)value;
+	return 0;
+}
+
+static void usage(const char* name) {
+	fprintf(stderr, "usage: %s [--size BYTES[K|M|G]] [--files N] [--urls N] [--referers N] [--zipf S]\n"
+		"       [--malformed RATIO] [--seed N] <output directory>\n", name);
+}
+
+// the long name of the option getopt_long() returned as opt
+static const char* option_name(const struct option* options, int opt) {
+	for (; options->name != NULL; options++) {
+		if (options->val == opt) {
+			return options->name;
+		}
+	}
+
+	return "?";
+}
+
+int main(int argc, char *argv[]) {
+	struct gen_options options = { .size = DEFAULT_SIZE, .files = DEFAULT_FILES, .urls = DEFAULT_URLS,
+		.referers = DEFAULT_REFERERS, .zipf = DEFAULT_ZIPF, .malformed = 0, .seed = DEFAULT_SEED };
+	static const struct option long_options[] = {
+		{ "size", required_argument, NULL, 's' },
+		{ "files", required_argument, NULL, 'f' },
+		{ "urls", required_argument, NULL, 'u' },
+		{ "referers", required_argument, NULL, 'r' },
+		{ "zipf", required_argument, NULL, 'z' },
+		{ "malformed", required_argument, NULL, 'm' },
+		{ "seed", required_argument, NULL, 'S' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "s:f:u:r:z:m:S:", long_options, NULL)) != -1) {
+		int ok = 1;
+		switch (opt) {
+		case 's':
+			ok = parse_size(optarg, &options.size) == 0;
+			break;
+		case 'f':
+			ok = sscanf(optarg, "%u", &options.files) == 1 && options.files > 0;
+			break;
+		case 'u':
+			ok = sscanf(optarg, "%u", &options.urls) == 1 && options.urls > 0;
+			break;
+		case 'r':
+			ok = sscanf(optarg, "%u", &options.referers) == 1 && options.referers > 0;
+			break;
+		case 'z':
+			ok = sscanf(optarg, "%lf", &options.zipf) == 1 && options.zipf >= 0;
+			break;
+		case 'm':
+			ok = sscanf(optarg, "%lf", &options.malformed) == 1 && options.malformed >= 0 && options.malformed <= 1;
+			break;
+		case 'S':
+			ok = sscanf(optarg, "%" SCNu64, &options.seed) == 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+
+		if (!ok) {
+			printf("wrong value \"%s\" for --%s\n", optarg, option_name(long_options, opt));
+			return 1;
+		}
+	}
+
+	if (argc - optind != 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	const char* dir = argv[optind];
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		perror("failed to create the output directory");
+		return 1;
+	}
+
+	return write_logs(dir, &options) == 0 ? 0 : 1;
+}